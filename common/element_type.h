@@ -0,0 +1,55 @@
+#ifndef IVF_ELEMENT_TYPE_H
+#define IVF_ELEMENT_TYPE_H
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include "../../include/storage.h"
+
+
+// Element types of the ANNS::Storage<T> datasets the indexes accept.
+enum class ElementType { FLOAT, INT8, UINT8 };
+
+
+inline ElementType elementType(const std::shared_ptr<ANNS::IStorage>& dataset) {
+    if (std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset)) {
+        return ElementType::FLOAT;
+    }
+    if (std::dynamic_pointer_cast<ANNS::Storage<int8_t>>(dataset)) {
+        return ElementType::INT8;
+    }
+    if (std::dynamic_pointer_cast<ANNS::Storage<uint8_t>>(dataset)) {
+        return ElementType::UINT8;
+    }
+    throw std::invalid_argument("unsupported storage element type");
+}
+
+
+inline size_t elementSize(ElementType type) {
+    return type == ElementType::FLOAT ? sizeof(float) : sizeof(int8_t);
+}
+
+
+// Returns vector i of the dataset as fp32. Float datasets are returned in
+// place; byte datasets are widened into buffer, which must hold dim floats.
+inline const float* vectorAsFloat(const std::shared_ptr<ANNS::IStorage>& dataset, ElementType type,
+                                  ANNS::IdxType i, int dim, float* buffer) {
+    const char* v = dataset->get_vector(i);
+    switch (type) {
+        case ElementType::INT8:
+            for (int j = 0; j < dim; j++) {
+                buffer[j] = reinterpret_cast<const int8_t*>(v)[j];
+            }
+            return buffer;
+        case ElementType::UINT8:
+            for (int j = 0; j < dim; j++) {
+                buffer[j] = reinterpret_cast<const uint8_t*>(v)[j];
+            }
+            return buffer;
+        default:
+            return reinterpret_cast<const float*>(v);
+    }
+}
+
+
+#endif
@@ -0,0 +1,22 @@
+# SIMD kernels shared by the IVF libraries. kernels_impl.h is compiled once per
+# instruction set, each translation unit with its own target flags, and
+# kernels.cpp picks the best variant for the running CPU at startup. Nothing
+# else is built with -march, so one artifact runs on every generation.
+
+set(KERNEL_SRC_FILES
+    ${CMAKE_CURRENT_LIST_DIR}/kernels.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/kernels_scalar.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/kernels_sse42.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/kernels_avx2.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/kernels_avx512.cpp
+)
+
+set_source_files_properties(${CMAKE_CURRENT_LIST_DIR}/kernels_sse42.cpp
+    PROPERTIES COMPILE_FLAGS "-msse4.2")
+set_source_files_properties(${CMAKE_CURRENT_LIST_DIR}/kernels_avx2.cpp
+    PROPERTIES COMPILE_FLAGS "-mavx2 -mfma -mf16c")
+# GCC 12's avx512fintrin.h seeds many intrinsics (reductions, conversions,
+# shuffles) with _mm512_undefined_*, and -Wall then reports the inlined
+# kernels as using uninitialized values (GCC bug 105593, a false positive).
+set_source_files_properties(${CMAKE_CURRENT_LIST_DIR}/kernels_avx512.cpp
+    PROPERTIES COMPILE_FLAGS "-mavx512f -mavx512bw -mavx2 -mfma -mf16c -Wno-uninitialized -Wno-maybe-uninitialized")
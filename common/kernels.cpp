@@ -0,0 +1,58 @@
+#include "kernels.h"
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+
+// Variants from the widest instruction set down. The scalar one only relies on
+// the x86-64 baseline and is always usable.
+static bool cpuSupports(int level) {
+    __builtin_cpu_init();
+    switch (level) {
+        case 0:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+                && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+        case 1:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+        case 2:
+            return __builtin_cpu_supports("sse4.2");
+        default:
+            return true;
+    }
+}
+
+
+static const SimdKernels& detectKernels() {
+    const SimdKernels* variants[] = {&avx512Kernels(), &avx2Kernels(), &sse42Kernels(), &scalarKernels()};
+    const int num_variants = sizeof(variants) / sizeof(variants[0]);
+
+    int first = 0;
+    const char* cap = std::getenv("IVF_SIMD_LEVEL");
+    if (cap != nullptr) {
+        //a misspelt level must not silently benchmark the widest variant
+        first = -1;
+        for (int i = 0; i < num_variants; i++) {
+            if (std::strcmp(cap, variants[i]->isa) == 0) {
+                first = i;
+            }
+        }
+        if (first < 0) {
+            throw std::invalid_argument(std::string("unknown IVF_SIMD_LEVEL ") + cap
+                                        + ", expected scalar, sse4.2, avx2 or avx512");
+        }
+    }
+
+    for (int i = first; i < num_variants; i++) {
+        if (cpuSupports(i)) {
+            return *variants[i];
+        }
+    }
+    return scalarKernels();
+}
+
+
+const SimdKernels& simdKernels() {
+    static const SimdKernels& kernels = detectKernels();
+    return kernels;
+}
@@ -0,0 +1,209 @@
+#ifndef IVF_KERNELS_H
+#define IVF_KERNELS_H
+
+#include <cstdint>
+#include <cstring>
+
+
+// The scalar helpers below are static: the kernels_<isa>.cpp files compile
+// them with wider target flags, and those copies must never be merged with the
+// ones the rest of the library calls.
+
+// Scalar fp16 (IEEE binary16) <-> fp32 conversions in plain bit manipulation,
+// so they behave the same in every kernel variant. Both round to nearest even.
+static inline uint16_t floatToFp16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exponent = ((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) {
+        // inf / nan
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;  // may carry into the exponent, which is the correct rounding
+    }
+    return half;
+}
+
+static inline float fp16ToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            x = sign;
+        } else {
+            // subnormal: renormalize
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if (exponent == 31) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+
+// bf16 is the upper half of an fp32; round to nearest even when narrowing.
+static inline uint16_t floatToBf16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        return (x >> 16) | 0x40;  // keep nan quiet
+    }
+    x += 0x7fff + ((x >> 16) & 1);
+    return x >> 16;
+}
+
+static inline float bf16ToFloat(uint16_t h) {
+    uint32_t x = (uint32_t)h << 16;
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+
+
+// Scalar quantizer codes are bit-packed little endian: code j of a vector
+// starts at bit j * nbits. This works for the 8, 6 and 4 bit variants alike.
+static inline uint8_t sqCode(const uint8_t* code, int j, int nbits) {
+    int bit = j * nbits;
+    int shift = bit & 7;
+    uint32_t word = code[bit >> 3];
+    if (shift + nbits > 8) {
+        word |= (uint32_t)code[(bit >> 3) + 1] << 8;
+    }
+    return (word >> shift) & ((1u << nbits) - 1);
+}
+
+static inline void sqSetCode(uint8_t* code, int j, int nbits, uint8_t value) {
+    int bit = j * nbits;
+    int shift = bit & 7;
+    uint32_t word = (uint32_t)value << shift;
+    code[bit >> 3] |= word & 0xff;
+    if (shift + nbits > 8) {
+        code[(bit >> 3) + 1] |= word >> 8;
+    }
+}
+
+
+// Type-erased kernel signature the indexes dispatch through. Vectors travel as
+// raw bytes, the same way the indexes pass them around everywhere else.
+typedef float (*DistanceKernel)(const char* a, const char* b, int dim);
+
+// Query against a scalar quantized code decoded as vmin + code * scale.
+typedef float (*SqKernel)(const float* q, const uint8_t* code, const float* vmin, const float* scale, int dim);
+
+// Asymmetric distance of a PQ code: sum over the m sub-quantizers of
+// table[j * ksub + code[j]].
+typedef float (*AdcKernel)(const float* table, const uint8_t* code, int m, int ksub);
+
+// Inner products of num_queries queries with n vectors, both stored row after
+// row: out[j * n + p] = <queries[j], x[p]>.
+typedef void (*IpBlockKernel)(const float* queries, int num_queries, const float* x, int n, int dim, float* out);
+
+// Squared L2 distance that may stop early once the partial sum reaches
+// threshold; the result is exact when below threshold and >= threshold otherwise.
+typedef float (*EarlyAbandonKernel)(const float* a, const float* b, int dim, float threshold);
+
+// Writes the positions p < n with distances[p] < threshold to out and returns
+// how many there were. Used to keep candidates that cannot enter the top-k
+// away from the heap.
+typedef int (*FilterKernel)(const float* distances, int n, float threshold, int* out);
+
+
+// Blocked (SoA) list layout: tiles of TILE_LANES vectors stored dimension by
+// dimension, i.e. tile[d * TILE_LANES + lane]. The dimension is padded to a
+// multiple of 8 with zeros so the tile kernel never needs a tail loop.
+constexpr int TILE_LANES = 16;
+
+inline int tilePaddedDim(int dim) {
+    return (dim + 7) / 8 * 8;
+}
+
+// Squared L2 distances (or inner products) between a padded query and the
+// TILE_LANES vectors of one 64-byte aligned tile, written to out[0..TILE_LANES).
+typedef void (*TileKernel)(const float* q, const float* tile, int padded_dim, float* out);
+
+
+// One set of kernels per instruction set. Every variant is compiled from
+// kernels_impl.h with its own target flags (kernels_<isa>.cpp); simdKernels()
+// picks the best one the CPU supports, once, on first use.
+struct SimdKernels {
+    const char* isa;
+    DistanceKernel (*l2_for_dim)(int dim);
+    DistanceKernel l2_fp16;
+    DistanceKernel l2_bf16;
+    DistanceKernel l2_int8;
+    DistanceKernel l2_uint8;
+    SqKernel l2_sq8;
+    SqKernel l2_sq6;
+    SqKernel l2_sq4;
+    AdcKernel adc;
+    TileKernel l2_tile;
+    DistanceKernel ip_float;   // inner products, fp32 query against a list vector
+    DistanceKernel ip_fp16;
+    DistanceKernel ip_bf16;
+    DistanceKernel ip_int8;
+    DistanceKernel ip_uint8;
+    TileKernel ip_tile;
+    IpBlockKernel ip_block;
+    EarlyAbandonKernel l2_early_abandon;
+    FilterKernel filter_below;
+};
+
+const SimdKernels& scalarKernels();
+const SimdKernels& sse42Kernels();
+const SimdKernels& avx2Kernels();
+const SimdKernels& avx512Kernels();
+
+// Best variant for this CPU. Setting IVF_SIMD_LEVEL to scalar, sse4.2, avx2 or
+// avx512 caps the choice, e.g. to compare variants on one machine; any other
+// value throws std::invalid_argument.
+const SimdKernels& simdKernels();
+
+// Name of the variant simdKernels() selected.
+inline const char* simdLevel() {
+    return simdKernels().isa;
+}
+
+
+// Picks the L2 kernel for a dimension: a specialised one for the full vector
+// sizes we deploy (96, 100, 128, 384, 768, 1024) and the PQ sub-vector sizes
+// (4, 8, 16), the generic loop otherwise. Meant to be called once per index.
+inline DistanceKernel selectL2Kernel(int dim) {
+    return simdKernels().l2_for_dim(dim);
+}
+
+
+#endif
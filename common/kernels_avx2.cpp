@@ -0,0 +1,14 @@
+#include <immintrin.h>
+#include <type_traits>
+#include "kernels.h"
+
+#define KERNELS_ISA "avx2"
+
+namespace kernels_avx2 {
+#include "kernels_impl.h"
+}
+
+
+const SimdKernels& avx2Kernels() {
+    return kernels_avx2::table;
+}
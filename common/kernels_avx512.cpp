@@ -0,0 +1,14 @@
+#include <immintrin.h>
+#include <type_traits>
+#include "kernels.h"
+
+#define KERNELS_ISA "avx512"
+
+namespace kernels_avx512 {
+#include "kernels_impl.h"
+}
+
+
+const SimdKernels& avx512Kernels() {
+    return kernels_avx512::table;
+}
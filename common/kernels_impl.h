@@ -0,0 +1,916 @@
+// Kernel bodies shared by every instruction set variant. This file has no
+// include guard on purpose: each kernels_<isa>.cpp includes it exactly once,
+// inside its own namespace and with its own target flags, after defining
+// KERNELS_ISA. The #if blocks below therefore resolve differently per variant.
+// Do not include it anywhere else.
+
+
+#if defined(__SSE4_1__)
+inline float horizontalSum(__m128 v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_movehdup_ps(v));
+    return _mm_cvtss_f32(v);
+}
+
+inline int32_t horizontalSum(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+#endif
+
+#if defined(__AVX__)
+inline float horizontalSum(__m256 v) {
+    return horizontalSum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+#endif
+
+
+// Squared L2 distance between an fp32 query and an fp16 list vector. The list
+// vector is widened in registers, so only dim * 2 bytes are streamed.
+inline float l2Fp16(const float* q, const uint16_t* x, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc16 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        __m512 xv = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(q + i), xv);
+        acc16 = _mm512_fmadd_ps(diff, diff, acc16);
+    }
+    sum += _mm512_reduce_add_ps(acc16);
+#endif
+#if defined(__AVX__) && defined(__F16C__)
+    __m256 acc8 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256 xv = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(q + i), xv);
+        acc8 = _mm256_add_ps(_mm256_mul_ps(diff, diff), acc8);
+    }
+    sum += horizontalSum(acc8);
+#endif
+    for (; i < dim; i++) {
+        float diff = q[i] - fp16ToFloat(x[i]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+
+// Squared L2 distance between an fp32 query and a bf16 list vector; widening is
+// a zero-extend and a 16 bit shift.
+inline float l2Bf16(const float* q, const uint16_t* x, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc16 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        __m512 xv = _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(q + i), xv);
+        acc16 = _mm512_fmadd_ps(diff, diff, acc16);
+    }
+    sum += _mm512_reduce_add_ps(acc16);
+#endif
+#if defined(__AVX2__)
+    __m256 acc8 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        __m256 xv = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(q + i), xv);
+        acc8 = _mm256_add_ps(_mm256_mul_ps(diff, diff), acc8);
+    }
+    sum += horizontalSum(acc8);
+#endif
+    for (; i < dim; i++) {
+        float diff = q[i] - bf16ToFloat(x[i]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+// Inner products of an fp32 query with fp16 and bf16 list vectors, widened the
+// same way as in l2Fp16 and l2Bf16.
+inline float ipFp16(const float* q, const uint16_t* x, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc16 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        __m512 xv = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        acc16 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), xv, acc16);
+    }
+    sum += _mm512_reduce_add_ps(acc16);
+#endif
+#if defined(__AVX__) && defined(__F16C__)
+    __m256 acc8 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256 xv = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        acc8 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q + i), xv), acc8);
+    }
+    sum += horizontalSum(acc8);
+#endif
+    for (; i < dim; i++) {
+        sum += q[i] * fp16ToFloat(x[i]);
+    }
+    return sum;
+}
+
+inline float ipBf16(const float* q, const uint16_t* x, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc16 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        __m512 xv = _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+        acc16 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), xv, acc16);
+    }
+    sum += _mm512_reduce_add_ps(acc16);
+#endif
+#if defined(__AVX2__)
+    __m256 acc8 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        __m256 xv = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+        acc8 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q + i), xv), acc8);
+    }
+    sum += horizontalSum(acc8);
+#endif
+    for (; i < dim; i++) {
+        sum += q[i] * bf16ToFloat(x[i]);
+    }
+    return sum;
+}
+
+// Accumulates the squared difference between q[0..16) and 16 8-bit codes
+// decoded as vmin + code * scale. Decoding happens in registers.
+#if defined(__AVX512F__)
+inline __m512 sqAccumulate16(__m512 acc, const float* q, __m128i codes, const float* vmin, const float* scale) {
+    __m512 c = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(codes));
+    __m512 x = _mm512_fmadd_ps(c, _mm512_loadu_ps(scale), _mm512_loadu_ps(vmin));
+    __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(q), x);
+    return _mm512_fmadd_ps(diff, diff, acc);
+}
+#elif defined(__AVX2__)
+inline __m256 sqAccumulate8(__m256 acc, const float* q, __m128i codes, const float* vmin, const float* scale) {
+    __m256 c = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(codes));
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(c, _mm256_loadu_ps(scale)), _mm256_loadu_ps(vmin));
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(q), x);
+    return _mm256_add_ps(_mm256_mul_ps(diff, diff), acc);
+}
+
+inline __m256 sqAccumulate16(__m256 acc, const float* q, __m128i codes, const float* vmin, const float* scale) {
+    acc = sqAccumulate8(acc, q, codes, vmin, scale);
+    return sqAccumulate8(acc, q + 8, _mm_srli_si128(codes, 8), vmin + 8, scale + 8);
+}
+#endif
+
+
+inline float sqTail(const float* q, const uint8_t* code, const float* vmin, const float* scale, int from, int dim, int nbits) {
+    float sum = 0;
+    for (int j = from; j < dim; j++) {
+        float diff = q[j] - (vmin[j] + sqCode(code, j, nbits) * scale[j]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+
+// Squared L2 distance between an fp32 query and an 8-bit scalar quantized vector.
+inline float l2Sq8(const float* q, const uint8_t* code, const float* vmin, const float* scale, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        __m128i codes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(code + i));
+        acc = sqAccumulate16(acc, q + i, codes, vmin + i, scale + i);
+    }
+    sum += _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m128i codes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(code + i));
+        acc = sqAccumulate8(acc, q + i, codes, vmin + i, scale + i);
+    }
+    sum += horizontalSum(acc);
+#elif defined(__SSE4_1__)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= dim; i += 4) {
+        int32_t packed;
+        std::memcpy(&packed, code + i, sizeof(packed));
+        __m128 c = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+        __m128 x = _mm_add_ps(_mm_mul_ps(c, _mm_loadu_ps(scale + i)), _mm_loadu_ps(vmin + i));
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(q + i), x);
+        acc = _mm_add_ps(_mm_mul_ps(diff, diff), acc);
+    }
+    sum += horizontalSum(acc);
+#endif
+    return sum + sqTail(q, code, vmin, scale, i, dim, 8);
+}
+
+
+// 4-bit variant: 8 bytes hold 16 codes, split into nibbles and re-interleaved
+// so that they come out in dimension order.
+inline float l2Sq4(const float* q, const uint8_t* code, const float* vmin, const float* scale, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__) || defined(__AVX2__)
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+#else
+    __m256 acc = _mm256_setzero_ps();
+#endif
+    const __m128i low_mask = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= dim; i += 16) {
+        __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(code + i / 2));
+        __m128i lo = _mm_and_si128(packed, low_mask);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), low_mask);
+        acc = sqAccumulate16(acc, q + i, _mm_unpacklo_epi8(lo, hi), vmin + i, scale + i);
+    }
+#if defined(__AVX512F__)
+    sum += _mm512_reduce_add_ps(acc);
+#else
+    sum += horizontalSum(acc);
+#endif
+#endif
+    return sum + sqTail(q, code, vmin, scale, i, dim, 4);
+}
+
+
+#if defined(__AVX2__)
+// Loads exactly 12 bytes so the last vector of a list never reads past its codes.
+inline __m128i sqLoad12(const uint8_t* p) {
+    int32_t tail;
+    std::memcpy(&tail, p + 8, sizeof(tail));
+    return _mm_insert_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), tail, 2);
+}
+#endif
+
+
+// 6-bit variant: 12 bytes hold 16 codes, four codes per 3 byte group. Each
+// group is shuffled into 32 bit lanes and the codes are shifted out in place.
+inline float l2Sq6(const float* q, const uint8_t* code, const float* vmin, const float* scale, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+    __m512 acc = _mm512_setzero_ps();
+    const __m512i gather = _mm512_set_epi32(
+        0x800b0a09, 0x800b0a09, 0x800b0a09, 0x800b0a09,
+        0x80080706, 0x80080706, 0x80080706, 0x80080706,
+        0x80050403, 0x80050403, 0x80050403, 0x80050403,
+        0x80020100, 0x80020100, 0x80020100, 0x80020100);
+    const __m512i shifts = _mm512_set_epi32(18, 12, 6, 0, 18, 12, 6, 0, 18, 12, 6, 0, 18, 12, 6, 0);
+    const __m512i mask = _mm512_set1_epi32(0x3f);
+    for (; i + 16 <= dim; i += 16) {
+        __m128i packed = sqLoad12(code + i / 4 * 3);
+        __m512i words = _mm512_shuffle_epi8(_mm512_broadcast_i32x4(packed), gather);
+        __m512i codes = _mm512_and_si512(_mm512_srlv_epi32(words, shifts), mask);
+        __m512 x = _mm512_fmadd_ps(_mm512_cvtepi32_ps(codes), _mm512_loadu_ps(scale + i), _mm512_loadu_ps(vmin + i));
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(q + i), x);
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+    sum += _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    const __m256i gather_lo = _mm256_set_epi32(
+        0x80050403, 0x80050403, 0x80050403, 0x80050403,
+        0x80020100, 0x80020100, 0x80020100, 0x80020100);
+    const __m256i gather_hi = _mm256_set_epi32(
+        0x800b0a09, 0x800b0a09, 0x800b0a09, 0x800b0a09,
+        0x80080706, 0x80080706, 0x80080706, 0x80080706);
+    const __m256i shifts = _mm256_set_epi32(18, 12, 6, 0, 18, 12, 6, 0);
+    const __m256i mask = _mm256_set1_epi32(0x3f);
+    for (; i + 16 <= dim; i += 16) {
+        __m128i packed = sqLoad12(code + i / 4 * 3);
+        __m256i both = _mm256_broadcastsi128_si256(packed);
+        __m256i codes[2] = {
+            _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(both, gather_lo), shifts), mask),
+            _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(both, gather_hi), shifts), mask)};
+        for (int h = 0; h < 2; h++) {
+            __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(codes[h]), _mm256_loadu_ps(scale + i + 8 * h)),
+                                     _mm256_loadu_ps(vmin + i + 8 * h));
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(q + i + 8 * h), x);
+            acc = _mm256_add_ps(_mm256_mul_ps(diff, diff), acc);
+        }
+    }
+    sum += horizontalSum(acc);
+#endif
+    return sum + sqTail(q, code, vmin, scale, i, dim, 6);
+}
+
+
+// Squared L2 distance between two int8 or uint8 vectors, computed exactly in
+// integers: bytes are widened to int16, differenced and squared-and-summed
+// with madd.
+template <typename T>
+inline float l2Bytes(const T* a, const T* b, int dim) {
+    static_assert(sizeof(T) == 1, "l2Bytes expects int8_t or uint8_t elements");
+    int i = 0;
+    int32_t sum = 0;
+#if defined(__AVX512BW__)
+    __m512i acc = _mm512_setzero_si512();
+    for (; i + 32 <= dim; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m512i diff;
+        if constexpr (std::is_signed<T>::value) {
+            diff = _mm512_sub_epi16(_mm512_cvtepi8_epi16(va), _mm512_cvtepi8_epi16(vb));
+        } else {
+            diff = _mm512_sub_epi16(_mm512_cvtepu8_epi16(va), _mm512_cvtepu8_epi16(vb));
+        }
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff, diff));
+    }
+    sum += _mm512_reduce_add_epi32(acc);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= dim; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m256i diff;
+        if constexpr (std::is_signed<T>::value) {
+            diff = _mm256_sub_epi16(_mm256_cvtepi8_epi16(va), _mm256_cvtepi8_epi16(vb));
+        } else {
+            diff = _mm256_sub_epi16(_mm256_cvtepu8_epi16(va), _mm256_cvtepu8_epi16(vb));
+        }
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+    }
+    sum += horizontalSum(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+#elif defined(__SSE4_1__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= dim; i += 8) {
+        __m128i va = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + i));
+        __m128i diff;
+        if constexpr (std::is_signed<T>::value) {
+            diff = _mm_sub_epi16(_mm_cvtepi8_epi16(va), _mm_cvtepi8_epi16(vb));
+        } else {
+            diff = _mm_sub_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb));
+        }
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(diff, diff));
+    }
+    sum += horizontalSum(acc);
+#endif
+    for (; i < dim; i++) {
+        int32_t diff = (int32_t)a[i] - (int32_t)b[i];
+        sum += diff * diff;
+    }
+    return (float)sum;
+}
+
+
+// Inner product of two byte vectors, exact in int32 like l2Bytes.
+template <typename T>
+inline float ipBytes(const T* a, const T* b, int dim) {
+    static_assert(sizeof(T) == 1, "ipBytes expects int8_t or uint8_t elements");
+    int i = 0;
+    int32_t sum = 0;
+#if defined(__AVX512BW__)
+    __m512i acc = _mm512_setzero_si512();
+    for (; i + 32 <= dim; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if constexpr (std::is_signed<T>::value) {
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_cvtepi8_epi16(va), _mm512_cvtepi8_epi16(vb)));
+        } else {
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_cvtepu8_epi16(va), _mm512_cvtepu8_epi16(vb)));
+        }
+    }
+    sum += _mm512_reduce_add_epi32(acc);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= dim; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        if constexpr (std::is_signed<T>::value) {
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepi8_epi16(va), _mm256_cvtepi8_epi16(vb)));
+        } else {
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepu8_epi16(va), _mm256_cvtepu8_epi16(vb)));
+        }
+    }
+    sum += horizontalSum(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+#elif defined(__SSE4_1__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= dim; i += 8) {
+        __m128i va = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + i));
+        if constexpr (std::is_signed<T>::value) {
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_cvtepi8_epi16(va), _mm_cvtepi8_epi16(vb)));
+        } else {
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb)));
+        }
+    }
+    sum += horizontalSum(acc);
+#endif
+    for (; i < dim; i++) {
+        sum += (int32_t)a[i] * (int32_t)b[i];
+    }
+    return (float)sum;
+}
+
+
+// Adapts a typed kernel to the DistanceKernel signature.
+template <typename A, typename B, float (*Kernel)(const A*, const B*, int)>
+inline float eraseTypes(const char* a, const char* b, int dim) {
+    return Kernel(reinterpret_cast<const A*>(a), reinterpret_cast<const B*>(b), dim);
+}
+
+
+#if defined(__AVX__)
+// Lane masks for _mm256_maskload_ps: loading at tailMask + 8 - n enables the
+// first n lanes.
+alignas(32) static const int32_t tailMask[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+#endif
+
+
+// Squared L2 distance for any dimension.
+inline float l2Float(const float* a, const float* b, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc16 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc16 = _mm512_fmadd_ps(diff, diff, acc16);
+    }
+    if (i < dim) {
+        __mmask16 mask = (__mmask16)((1u << (dim - i)) - 1);
+        __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc16 = _mm512_fmadd_ps(diff, diff, acc16);
+        i = dim;
+    }
+    sum += _mm512_reduce_add_ps(acc16);
+#elif defined(__AVX__)
+    __m256 acc8 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc8 = _mm256_add_ps(_mm256_mul_ps(diff, diff), acc8);
+    }
+    sum += horizontalSum(acc8);
+#elif defined(__SSE4_1__)
+    __m128 acc4 = _mm_setzero_ps();
+    for (; i + 4 <= dim; i += 4) {
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc4 = _mm_add_ps(_mm_mul_ps(diff, diff), acc4);
+    }
+    sum += horizontalSum(acc4);
+#endif
+    for (; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+
+// Squared L2 distance with the dimension fixed at compile time. All trip counts
+// are constants, so the loops unroll completely, the accumulators stay in
+// registers and the tail is a single masked load instead of a scalar loop.
+template <int D>
+inline float l2Fixed(const float* a, const float* b, int) {
+#if defined(__AVX512F__)
+    if constexpr (D >= 16) {
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        int i = 0;
+        for (; i + 32 <= D; i += 32) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+            acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+        }
+        if constexpr (D % 32 >= 16) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+            i += 16;
+        }
+        if constexpr (D % 16 != 0) {
+            const __mmask16 mask = (__mmask16)((1u << (D % 16)) - 1);
+            __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+            acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    }
+#endif
+#if defined(__AVX__)
+    if constexpr (D >= 8) {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= D; i += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+            acc0 = _mm256_add_ps(_mm256_mul_ps(d0, d0), acc0);
+            acc1 = _mm256_add_ps(_mm256_mul_ps(d1, d1), acc1);
+        }
+        if constexpr (D % 16 >= 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            acc0 = _mm256_add_ps(_mm256_mul_ps(d0, d0), acc0);
+            i += 8;
+        }
+        if constexpr (D % 8 != 0) {
+            const __m256i mask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tailMask + 8 - D % 8));
+            __m256 d1 = _mm256_sub_ps(_mm256_maskload_ps(a + i, mask), _mm256_maskload_ps(b + i, mask));
+            acc1 = _mm256_add_ps(_mm256_mul_ps(d1, d1), acc1);
+        }
+        return horizontalSum(_mm256_add_ps(acc0, acc1));
+    }
+#endif
+#if defined(__SSE4_1__)
+    if constexpr (D >= 4) {
+        __m128 acc = _mm_setzero_ps();
+        int i = 0;
+        for (; i + 4 <= D; i += 4) {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            acc = _mm_add_ps(_mm_mul_ps(diff, diff), acc);
+        }
+        float sum = horizontalSum(acc);
+        for (; i < D; i++) {
+            float diff = a[i] - b[i];
+            sum += diff * diff;
+        }
+        return sum;
+    }
+#endif
+    float sum = 0;
+    for (int i = 0; i < D; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+
+// Squared L2 distance that gives up once the running sum reaches threshold
+// (the current k-th best), checking after every 32 coordinates. The return
+// value is then only known to be >= threshold. Partial sums of squares only
+// grow, so no candidate that could enter the top-k is dropped.
+inline float l2FloatEarlyAbandon(const float* a, const float* b, int dim, float threshold) {
+    int i = 0;
+    float sum = 0;
+    for (; i + 32 <= dim; i += 32) {
+        sum += l2Fixed<32>(a + i, b + i, 32);
+        if (sum >= threshold) {
+            return sum;
+        }
+    }
+    return sum + l2Float(a + i, b + i, dim - i);
+}
+
+
+// Inner product for any dimension. Together with a stored ||x||^2 it gives
+// the L2 distance as ||q||^2 + ||x||^2 - 2<q, x>, which needs one multiply-add
+// per coordinate instead of a subtract and a multiply-add.
+inline float ipFloat(const float* a, const float* b, int dim) {
+    int i = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    for (; i + 32 <= dim; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i < dim; i += 16) {
+        __mmask16 mask = dim - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (dim - i)) - 1);
+        acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc0);
+    }
+    i = dim;
+    sum += _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+#elif defined(__AVX__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= dim; i += 16) {
+        acc0 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), acc0);
+        acc1 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)), acc1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), acc0);
+    }
+    sum += horizontalSum(_mm256_add_ps(acc0, acc1));
+#elif defined(__SSE4_1__)
+    __m128 acc4 = _mm_setzero_ps();
+    for (; i + 4 <= dim; i += 4) {
+        acc4 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), acc4);
+    }
+    sum += horizontalSum(acc4);
+#endif
+    for (; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+
+// Inner products of four queries, dim apart in q, with one vector x: each
+// load of x feeds four multiply-adds.
+inline void ipFourQueries(const float* q, const float* x, int dim, float* sums) {
+    const float* q0 = q;
+    const float* q1 = q + dim;
+    const float* q2 = q + 2 * dim;
+    const float* q3 = q + 3 * dim;
+    int i = 0;
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps();
+    __m512 acc3 = _mm512_setzero_ps();
+    for (; i < dim; i += 16) {
+        __mmask16 mask = dim - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (dim - i)) - 1);
+        __m512 xv = _mm512_maskz_loadu_ps(mask, x + i);
+        acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q0 + i), xv, acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q1 + i), xv, acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q2 + i), xv, acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q3 + i), xv, acc3);
+    }
+    s0 = _mm512_reduce_add_ps(acc0);
+    s1 = _mm512_reduce_add_ps(acc1);
+    s2 = _mm512_reduce_add_ps(acc2);
+    s3 = _mm512_reduce_add_ps(acc3);
+#elif defined(__AVX__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256 xv = _mm256_loadu_ps(x + i);
+        acc0 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q0 + i), xv), acc0);
+        acc1 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q1 + i), xv), acc1);
+        acc2 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q2 + i), xv), acc2);
+        acc3 = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q3 + i), xv), acc3);
+    }
+    s0 = horizontalSum(acc0);
+    s1 = horizontalSum(acc1);
+    s2 = horizontalSum(acc2);
+    s3 = horizontalSum(acc3);
+#elif defined(__SSE4_1__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    __m128 acc2 = _mm_setzero_ps();
+    __m128 acc3 = _mm_setzero_ps();
+    for (; i + 4 <= dim; i += 4) {
+        __m128 xv = _mm_loadu_ps(x + i);
+        acc0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q0 + i), xv), acc0);
+        acc1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q1 + i), xv), acc1);
+        acc2 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q2 + i), xv), acc2);
+        acc3 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q3 + i), xv), acc3);
+    }
+    s0 = horizontalSum(acc0);
+    s1 = horizontalSum(acc1);
+    s2 = horizontalSum(acc2);
+    s3 = horizontalSum(acc3);
+#endif
+    for (; i < dim; i++) {
+        s0 += q0[i] * x[i];
+        s1 += q1[i] * x[i];
+        s2 += q2[i] * x[i];
+        s3 += q3[i] * x[i];
+    }
+    sums[0] = s0;
+    sums[1] = s1;
+    sums[2] = s2;
+    sums[3] = s3;
+}
+
+
+// Inner products of a block of queries with a block of list vectors, a small
+// matrix product. Queries are taken four at a time so that every list vector
+// is read once per four queries while they sit in registers and L1.
+inline void ipBlock(const float* queries, int num_queries, const float* x, int n, int dim, float* out) {
+    int j = 0;
+    for (; j + 4 <= num_queries; j += 4) {
+        const float* q = queries + (size_t)j * dim;
+        for (int p = 0; p < n; p++) {
+            float sums[4];
+            ipFourQueries(q, x + (size_t)p * dim, dim, sums);
+            for (int l = 0; l < 4; l++) {
+                out[(size_t)(j + l) * n + p] = sums[l];
+            }
+        }
+    }
+    for (; j < num_queries; j++) {
+        for (int p = 0; p < n; p++) {
+            out[(size_t)j * n + p] = ipFloat(queries + (size_t)j * dim, x + (size_t)p * dim, dim);
+        }
+    }
+}
+
+
+// Inner products between a padded query and the vectors of one tile; the
+// vertical counterpart of ipFloat, laid out like l2Tile.
+inline void ipTile(const float* q, const float* tile, int padded_dim, float* out) {
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    for (int d = 0; d < padded_dim; d += 2) {
+        acc0 = _mm512_fmadd_ps(_mm512_set1_ps(q[d]), _mm512_load_ps(tile + d * TILE_LANES), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_set1_ps(q[d + 1]), _mm512_load_ps(tile + (d + 1) * TILE_LANES), acc1);
+    }
+    _mm512_storeu_ps(out, _mm512_add_ps(acc0, acc1));
+#elif defined(__AVX__)
+    __m256 lo = _mm256_setzero_ps();
+    __m256 hi = _mm256_setzero_ps();
+    for (int d = 0; d < padded_dim; d++) {
+        __m256 qd = _mm256_set1_ps(q[d]);
+        lo = _mm256_add_ps(_mm256_mul_ps(qd, _mm256_load_ps(tile + d * TILE_LANES)), lo);
+        hi = _mm256_add_ps(_mm256_mul_ps(qd, _mm256_load_ps(tile + d * TILE_LANES + 8)), hi);
+    }
+    _mm256_storeu_ps(out, lo);
+    _mm256_storeu_ps(out + 8, hi);
+#elif defined(__SSE4_1__)
+    __m128 acc[TILE_LANES / 4];
+    for (int l = 0; l < TILE_LANES / 4; l++) {
+        acc[l] = _mm_setzero_ps();
+    }
+    for (int d = 0; d < padded_dim; d++) {
+        __m128 qd = _mm_set1_ps(q[d]);
+        for (int l = 0; l < TILE_LANES / 4; l++) {
+            acc[l] = _mm_add_ps(_mm_mul_ps(qd, _mm_load_ps(tile + d * TILE_LANES + 4 * l)), acc[l]);
+        }
+    }
+    for (int l = 0; l < TILE_LANES / 4; l++) {
+        _mm_storeu_ps(out + 4 * l, acc[l]);
+    }
+#else
+    for (int l = 0; l < TILE_LANES; l++) {
+        out[l] = 0;
+    }
+    for (int d = 0; d < padded_dim; d++) {
+        for (int l = 0; l < TILE_LANES; l++) {
+            out[l] += q[d] * tile[d * TILE_LANES + l];
+        }
+    }
+#endif
+}
+
+
+// Scores a whole tile with vertical SIMD only: each step broadcasts one query
+// coordinate against that coordinate of every vector in the tile, so there is
+// no horizontal reduction and, thanks to the padding, no tail.
+inline void l2Tile(const float* q, const float* tile, int padded_dim, float* out) {
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    for (int d = 0; d < padded_dim; d += 2) {
+        __m512 diff0 = _mm512_sub_ps(_mm512_set1_ps(q[d]), _mm512_load_ps(tile + d * TILE_LANES));
+        __m512 diff1 = _mm512_sub_ps(_mm512_set1_ps(q[d + 1]), _mm512_load_ps(tile + (d + 1) * TILE_LANES));
+        acc0 = _mm512_fmadd_ps(diff0, diff0, acc0);
+        acc1 = _mm512_fmadd_ps(diff1, diff1, acc1);
+    }
+    _mm512_storeu_ps(out, _mm512_add_ps(acc0, acc1));
+#elif defined(__AVX__)
+    __m256 lo = _mm256_setzero_ps();
+    __m256 hi = _mm256_setzero_ps();
+    for (int d = 0; d < padded_dim; d++) {
+        __m256 qd = _mm256_set1_ps(q[d]);
+        __m256 diff_lo = _mm256_sub_ps(qd, _mm256_load_ps(tile + d * TILE_LANES));
+        __m256 diff_hi = _mm256_sub_ps(qd, _mm256_load_ps(tile + d * TILE_LANES + 8));
+        lo = _mm256_add_ps(_mm256_mul_ps(diff_lo, diff_lo), lo);
+        hi = _mm256_add_ps(_mm256_mul_ps(diff_hi, diff_hi), hi);
+    }
+    _mm256_storeu_ps(out, lo);
+    _mm256_storeu_ps(out + 8, hi);
+#elif defined(__SSE4_1__)
+    __m128 acc[TILE_LANES / 4];
+    for (int l = 0; l < TILE_LANES / 4; l++) {
+        acc[l] = _mm_setzero_ps();
+    }
+    for (int d = 0; d < padded_dim; d++) {
+        __m128 qd = _mm_set1_ps(q[d]);
+        for (int l = 0; l < TILE_LANES / 4; l++) {
+            __m128 diff = _mm_sub_ps(qd, _mm_load_ps(tile + d * TILE_LANES + 4 * l));
+            acc[l] = _mm_add_ps(_mm_mul_ps(diff, diff), acc[l]);
+        }
+    }
+    for (int l = 0; l < TILE_LANES / 4; l++) {
+        _mm_storeu_ps(out + 4 * l, acc[l]);
+    }
+#else
+    for (int l = 0; l < TILE_LANES; l++) {
+        out[l] = 0;
+    }
+    for (int d = 0; d < padded_dim; d++) {
+        for (int l = 0; l < TILE_LANES; l++) {
+            float diff = q[d] - tile[d * TILE_LANES + l];
+            out[l] += diff * diff;
+        }
+    }
+#endif
+}
+
+
+// Asymmetric distance computation for PQ: the query's distances to every
+// codeword are precomputed in table, so a code costs m lookups. The lookups
+// are done as gathers, 16 or 8 sub-quantizers at a time.
+inline float adcDistance(const float* table, const uint8_t* code, int m, int ksub) {
+    int j = 0;
+    float sum = 0;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    const __m512i rows = _mm512_mullo_epi32(
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(ksub));
+    for (; j + 16 <= m; j += 16) {
+        __m512i codes = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(code + j)));
+        acc = _mm512_add_ps(acc, _mm512_i32gather_ps(_mm512_add_epi32(codes, rows), table + j * ksub, 4));
+    }
+    sum += _mm512_reduce_add_ps(acc);
+#endif
+#if defined(__AVX2__)
+    __m256 acc8 = _mm256_setzero_ps();
+    const __m256i rows8 = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(ksub));
+    for (; j + 8 <= m; j += 8) {
+        __m256i codes = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code + j)));
+        acc8 = _mm256_add_ps(acc8, _mm256_i32gather_ps(table + j * ksub, _mm256_add_epi32(codes, rows8), 4));
+    }
+    sum += horizontalSum(acc8);
+#endif
+    for (; j < m; j++) {
+        sum += table[j * ksub + code[j]];
+    }
+    return sum;
+}
+
+
+// Compares a block of distances against the current k-th distance and
+// compacts the positions that can still enter the top-k.
+inline int filterBelow(const float* distances, int n, float threshold, int* out) {
+    int p = 0;
+    int count = 0;
+#if defined(__AVX512F__)
+    const __m512 limit = _mm512_set1_ps(threshold);
+    const __m512i step = _mm512_set1_epi32(16);
+    __m512i positions = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for (; p + 16 <= n; p += 16) {
+        __mmask16 below = _mm512_cmp_ps_mask(_mm512_loadu_ps(distances + p), limit, _CMP_LT_OQ);
+        _mm512_mask_compressstoreu_epi32(out + count, below, positions);
+        count += __builtin_popcount(below);
+        positions = _mm512_add_epi32(positions, step);
+    }
+#elif defined(__AVX__)
+    const __m256 limit = _mm256_set1_ps(threshold);
+    for (; p + 8 <= n; p += 8) {
+        int below = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(distances + p), limit, _CMP_LT_OQ));
+        while (below) {
+            out[count++] = p + __builtin_ctz(below);
+            below &= below - 1;
+        }
+    }
+#elif defined(__SSE4_1__)
+    const __m128 limit = _mm_set1_ps(threshold);
+    for (; p + 4 <= n; p += 4) {
+        int below = _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(distances + p), limit));
+        while (below) {
+            out[count++] = p + __builtin_ctz(below);
+            below &= below - 1;
+        }
+    }
+#endif
+    for (; p < n; p++) {
+        if (distances[p] < threshold) {
+            out[count++] = p;
+        }
+    }
+    return count;
+}
+
+
+inline DistanceKernel l2ForDim(int dim) {
+    switch (dim) {
+        case 4: return eraseTypes<float, float, l2Fixed<4>>;
+        case 8: return eraseTypes<float, float, l2Fixed<8>>;
+        case 16: return eraseTypes<float, float, l2Fixed<16>>;
+        case 96: return eraseTypes<float, float, l2Fixed<96>>;
+        case 100: return eraseTypes<float, float, l2Fixed<100>>;
+        case 128: return eraseTypes<float, float, l2Fixed<128>>;
+        case 384: return eraseTypes<float, float, l2Fixed<384>>;
+        case 768: return eraseTypes<float, float, l2Fixed<768>>;
+        case 1024: return eraseTypes<float, float, l2Fixed<1024>>;
+        default: return eraseTypes<float, float, l2Float>;
+    }
+}
+
+
+const SimdKernels table = {
+    KERNELS_ISA,
+    l2ForDim,
+    eraseTypes<float, uint16_t, l2Fp16>,
+    eraseTypes<float, uint16_t, l2Bf16>,
+    eraseTypes<int8_t, int8_t, l2Bytes<int8_t>>,
+    eraseTypes<uint8_t, uint8_t, l2Bytes<uint8_t>>,
+    l2Sq8,
+    l2Sq6,
+    l2Sq4,
+    adcDistance,
+    l2Tile,
+    eraseTypes<float, float, ipFloat>,
+    eraseTypes<float, uint16_t, ipFp16>,
+    eraseTypes<float, uint16_t, ipBf16>,
+    eraseTypes<int8_t, int8_t, ipBytes<int8_t>>,
+    eraseTypes<uint8_t, uint8_t, ipBytes<uint8_t>>,
+    ipTile,
+    ipBlock,
+    l2FloatEarlyAbandon,
+    filterBelow,
+};
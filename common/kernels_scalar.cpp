@@ -0,0 +1,14 @@
+#include <immintrin.h>
+#include <type_traits>
+#include "kernels.h"
+
+#define KERNELS_ISA "scalar"
+
+namespace kernels_scalar {
+#include "kernels_impl.h"
+}
+
+
+const SimdKernels& scalarKernels() {
+    return kernels_scalar::table;
+}
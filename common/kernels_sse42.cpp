@@ -0,0 +1,14 @@
+#include <immintrin.h>
+#include <type_traits>
+#include "kernels.h"
+
+#define KERNELS_ISA "sse4.2"
+
+namespace kernels_sse42 {
+#include "kernels_impl.h"
+}
+
+
+const SimdKernels& sse42Kernels() {
+    return kernels_sse42::table;
+}
@@ -0,0 +1,622 @@
+#include "kmeans.h"
+#include "kernels.h"
+#include "metric.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <unordered_set>
+#include <utility>
+#include <cblas.h>
+
+
+// Floats of sgemm output a thread scores at a time, which bounds the vectors
+// per block for large k.
+static const size_t BLOCK_FLOATS = 1 << 20;
+static const int MAX_BLOCK_ROWS = 1024;
+
+// Rounds and centroid candidates per vector of the size-constrained phase.
+static const int BALANCE_ROUNDS = 10;
+static const int BALANCE_CANDIDATES = 8;
+
+// Relative offset between the two halves of a split cluster.
+static const float SPLIT_EPS = 1.0f / 1024;
+
+// Oversampling passes of k-means|| seeding.
+static const int PARALLEL_ROUNDS = 5;
+
+// Weight of the newest batch in the smoothed mini-batch objective.
+static const double MINI_BATCH_SMOOTHING = 0.25;
+
+
+// count distinct rows of [0, n), ascending, by Floyd's algorithm, so nothing
+// the size of the training set is allocated.
+static std::vector<size_t> sampleRows(size_t n, size_t count, std::mt19937_64& rng) {
+    std::unordered_set<size_t> chosen;
+    std::vector<size_t> rows;
+    rows.reserve(count);
+    for (size_t j = n - count; j < n; j++) {
+        size_t row = std::uniform_int_distribution<size_t>(0, j)(rng);
+        if (!chosen.insert(row).second) {
+            row = j;
+            chosen.insert(row);
+        }
+        rows.push_back(row);
+    }
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+
+KMeans::KMeans(int dim, int k, const KMeansParameters& p) : dim(dim), k(k), params(p) {
+    if (dim < 1 || k < 1 || p.iterations < 0) {
+        throw std::invalid_argument("k-means needs a positive dimension and cluster count");
+    }
+    if (p.tolerance < 0) {
+        throw std::invalid_argument("tolerance must not be negative");
+    }
+    if (p.max_cluster_ratio != 0 && p.max_cluster_ratio < 1) {
+        throw std::invalid_argument("max_cluster_ratio must be at least 1");
+    }
+}
+
+
+void KMeans::train(size_t n, const KMeansReader& read) {
+    if (n < (size_t)k) {
+        throw std::invalid_argument("k-means needs at least k training vectors");
+    }
+    if (params.refine_iterations < 0) {
+        throw std::invalid_argument("refine_iterations must not be negative");
+    }
+    auto started = std::chrono::steady_clock::now();
+    training_stats = KMeansStats();
+    std::vector<size_t> rows;
+    KMeansReader sampled = [&](size_t p, float* out) { read(rows[p], out); };
+    const KMeansReader* source = &read;
+    if (params.max_points_per_centroid > 0 && n > (size_t)k * params.max_points_per_centroid) {
+        std::mt19937_64 rng(params.seed ^ 0x5eed);
+        rows = sampleRows(n, (size_t)k * params.max_points_per_centroid, rng);
+        n = rows.size();
+        source = &sampled;
+    }
+    training_stats.points = n;
+    if (params.hierarchical && k > 1) {
+        trainHierarchical(n, *source);
+    } else {
+        seed(n, *source);
+        iterate(n, *source);
+    }
+    if (params.max_cluster_ratio > 0) {
+        balance(n, *source);
+    }
+    training_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+
+// The Lloyd or mini-batch iterations from the current centroids.
+void KMeans::iterate(size_t n, const KMeansReader& read) {
+    std::vector<size_t> absorbed(k, 0);
+    double smoothed = 0;
+    for (int iteration = 0; iteration < params.iterations; iteration++) {
+        double objective = params.batch_size > 0 ? miniBatchIteration(n, read, absorbed, iteration) : lloydIteration(n, read);
+        training_stats.objective.push_back(objective);
+        training_stats.iterations++;
+        double previous = smoothed;
+        smoothed = iteration == 0 || params.batch_size == 0 ? objective : (1 - MINI_BATCH_SMOOTHING) * smoothed + MINI_BATCH_SMOOTHING * objective;
+        if (iteration > 0 && params.tolerance > 0 && previous - smoothed < params.tolerance * previous) {
+            break;
+        }
+    }
+    if (params.batch_size > 0) {
+        training_stats.empty_clusters += std::count(absorbed.begin(), absorbed.end(), 0);
+    }
+}
+
+
+// Two-level training, see KMeansParameters::hierarchical.
+void KMeans::trainHierarchical(size_t n, const KMeansReader& read) {
+    KMeansParameters level = params;
+    level.hierarchical = false;
+    level.refine_iterations = 0;
+    level.max_cluster_ratio = 0;
+    int groups = std::max(1, (int)std::lround(std::sqrt((double)k)));
+    KMeans top(dim, groups, level);
+    top.train(n, read);
+    training_stats.empty_clusters += top.stats().empty_clusters;
+
+    std::vector<int> labels(n);
+    top.assign(n, read, 1, labels.data(), nullptr);
+    std::vector<size_t> start(groups + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        start[labels[i] + 1]++;
+    }
+    std::partial_sum(start.begin(), start.end(), start.begin());
+    std::vector<size_t> members(n);
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; i++) {
+        members[fill[labels[i]]++] = i;
+    }
+
+    //shares by highest averages: one per non-empty group, then each next
+    //centroid to the group with the most vectors per centroid and room left
+    std::vector<int> share(groups, 0);
+    int given = 0;
+    for (int g = 0; g < groups; g++) {
+        if (start[g + 1] > start[g]) {
+            share[g] = 1;
+            given++;
+        }
+    }
+    for (; given < k; given++) {
+        int best = -1;
+        double best_load = -1;
+        for (int g = 0; g < groups; g++) {
+            size_t size = start[g + 1] - start[g];
+            double load = (double)size / share[g];
+            if (share[g] > 0 && (size_t)share[g] < size && load > best_load) {
+                best_load = load;
+                best = g;
+            }
+        }
+        share[best]++;
+    }
+
+    //the groups run in parallel; each inner k-means then runs on one thread
+    std::vector<int> offset(groups + 1, 0);
+    std::partial_sum(share.begin(), share.end(), offset.begin() + 1);
+    centers.resize((size_t)k * dim);
+    std::vector<KMeansStats> group_stats(groups);
+    #pragma omp parallel for schedule(dynamic)
+    for (int g = 0; g < groups; g++) {
+        if (share[g] == 0) {
+            continue;
+        }
+        KMeansParameters inner = level;
+        inner.seed = params.seed + g + 1;
+        KMeans group(dim, share[g], inner);
+        group.train(start[g + 1] - start[g], [&](size_t p, float* out) { read(members[start[g] + p], out); });
+        std::copy(group.centers.begin(), group.centers.end(), centers.begin() + (size_t)offset[g] * dim);
+        group_stats[g] = group.stats();
+    }
+
+    double objective = 0;
+    for (int g = 0; g < groups; g++) {
+        if (share[g] > 0 && !group_stats[g].objective.empty()) {
+            objective += group_stats[g].objective.back() * (start[g + 1] - start[g]) / n;
+        }
+        training_stats.empty_clusters += group_stats[g].empty_clusters;
+    }
+    training_stats.objective.push_back(objective);
+    updateNorms();
+    for (int iteration = 0; iteration < params.refine_iterations; iteration++) {
+        training_stats.objective.push_back(lloydIteration(n, read));
+        training_stats.iterations++;
+    }
+}
+
+
+void KMeans::seed(size_t n, const KMeansReader& read) {
+    std::mt19937_64 rng(params.seed);
+    centers.resize((size_t)k * dim);
+    if (params.seeding == KMeansSeeding::PLUS_PLUS) {
+        plusPlus(n, read, nullptr, k, rng, centers.data());
+    } else if (params.seeding == KMeansSeeding::PARALLEL) {
+        seedParallel(n, read, rng);
+    } else {
+        std::vector<size_t> rows = sampleRows(n, k, rng);
+        #pragma omp parallel for
+        for (int c = 0; c < k; c++) {
+            read(rows[c], centers.data() + (size_t)c * dim);
+        }
+    }
+    if (params.spherical) {
+        for (int c = 0; c < k; c++) {
+            normalizeVector(centers.data() + (size_t)c * dim, centers.data() + (size_t)c * dim, dim);
+        }
+    }
+    updateNorms();
+}
+
+
+// k-means||: starting from one random vector, every round keeps each vector
+// with probability k * D(x) / sum D, D being its squared distance to the
+// nearest candidate so far. Each candidate is then weighted by the vectors
+// nearest to it, and weighted k-means++ picks the k centroids among them.
+void KMeans::seedParallel(size_t n, const KMeansReader& read, std::mt19937_64& rng) {
+    std::vector<float> candidates(dim);
+    read(std::uniform_int_distribution<size_t>(0, n - 1)(rng), candidates.data());
+    std::vector<float> distances(n, std::numeric_limits<float>::max());
+    size_t fresh = 0;   // first candidate distances have not seen yet
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (int round = 0; round < PARALLEL_ROUNDS; round++) {
+        size_t count = candidates.size() / dim;
+        lowerDistances(n, read, candidates.data() + fresh * dim, count - fresh, distances);
+        fresh = count;
+        double total = 0;
+        #pragma omp parallel for reduction(+ : total)
+        for (size_t i = 0; i < n; i++) {
+            total += distances[i];
+        }
+        if (total <= 0) {
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (uniform(rng) < k * distances[i] / total) {
+                candidates.resize(candidates.size() + dim);
+                read(i, candidates.data() + candidates.size() - dim);
+            }
+        }
+    }
+    size_t count = candidates.size() / dim;
+    if (count < (size_t)k) {
+        plusPlus(n, read, nullptr, k, rng, centers.data());
+        return;
+    }
+
+    KMeans picker(dim, count);
+    picker.centers = candidates;
+    picker.updateNorms();
+    std::vector<int> labels(n);
+    picker.assign(n, read, 1, labels.data(), nullptr);
+    std::vector<float> weights(count, 0.0f);
+    for (size_t i = 0; i < n; i++) {
+        weights[labels[i]]++;
+    }
+    KMeansReader from_candidates = [&](size_t c, float* out) {
+        std::memcpy(out, candidates.data() + c * dim, dim * sizeof(float));
+    };
+    plusPlus(count, from_candidates, weights.data(), k, rng, centers.data());
+}
+
+
+// k-means++: picks count of the n vectors into out, the first uniformly (by
+// weight when weights is set) and every next one with probability
+// proportional to weight * D(x), its squared distance to the nearest pick.
+void KMeans::plusPlus(size_t n, const KMeansReader& read, const float* weights, int count, std::mt19937_64& rng, float* out) {
+    std::vector<float> distances(n, std::numeric_limits<float>::max());
+    for (int c = 0; c < count; c++) {
+        if (c > 0) {
+            lowerDistances(n, read, out + (size_t)(c - 1) * dim, 1, distances);
+        }
+        auto mass = [&](size_t i) { return (weights ? weights[i] : 1.0) * (c > 0 ? distances[i] : 1.0); };
+        double total = 0;
+        #pragma omp parallel for reduction(+ : total)
+        for (size_t i = 0; i < n; i++) {
+            total += mass(i);
+        }
+        //all vectors coincide with picks: any vector will do
+        size_t pick = std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+        if (total > 0) {
+            double target = std::uniform_real_distribution<double>(0.0, total)(rng);
+            double running = 0;
+            for (size_t i = 0; i < n; i++) {
+                running += mass(i);
+                if (running >= target && mass(i) > 0) {
+                    pick = i;
+                    break;
+                }
+            }
+        }
+        read(pick, out + (size_t)c * dim);
+    }
+}
+
+
+// Lowers distances[i] to the squared distance from vector i to the nearest
+// of the count new centers, where that is nearer.
+void KMeans::lowerDistances(size_t n, const KMeansReader& read, const float* new_centers, int count, std::vector<float>& distances) {
+    if (count == 0) {
+        return;
+    }
+    std::vector<float> norms(count);
+    for (int c = 0; c < count; c++) {
+        const char* center = reinterpret_cast<const char*>(new_centers + (size_t)c * dim);
+        norms[c] = simdKernels().ip_float(center, center, dim);
+    }
+    const size_t block = std::max<size_t>(1, std::min<size_t>(MAX_BLOCK_ROWS, BLOCK_FLOATS / count));
+    #pragma omp parallel
+    {
+        std::vector<float> x(block * dim);
+        std::vector<float> products(block * count);
+        #pragma omp for schedule(dynamic)
+        for (size_t first = 0; first < n; first += block) {
+            int rows = std::min(block, n - first);
+            for (int r = 0; r < rows; r++) {
+                read(first + r, x.data() + (size_t)r * dim);
+            }
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, rows, count, dim, 1.0f, x.data(), dim,
+                        new_centers, dim, 0.0f, products.data(), count);
+            for (int r = 0; r < rows; r++) {
+                const char* row = reinterpret_cast<const char*>(x.data() + (size_t)r * dim);
+                float row_norm = simdKernels().ip_float(row, row, dim);
+                float& nearest_distance = distances[first + r];
+                for (int c = 0; c < count; c++) {
+                    float distance = std::max(0.0f, row_norm + norms[c] - 2 * products[(size_t)r * count + c]);
+                    nearest_distance = std::min(nearest_distance, distance);
+                }
+            }
+        }
+    }
+}
+
+
+// Returns the mean squared distance of the assignment it made.
+double KMeans::lloydIteration(size_t n, const KMeansReader& read) {
+    std::vector<int> labels(n);
+    double objective = assign(n, read, 1, labels.data(), nullptr) / n;
+
+    //members of cluster c are members[start[c], start[c + 1])
+    std::vector<size_t> start(k + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        start[labels[i] + 1]++;
+    }
+    std::partial_sum(start.begin(), start.end(), start.begin());
+    std::vector<size_t> members(n);
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; i++) {
+        members[fill[labels[i]]++] = i;
+    }
+    moveCentroids(members, start, read, nullptr);
+    return objective;
+}
+
+
+// One mini-batch step. The batch is the only copy of training vectors held.
+double KMeans::miniBatchIteration(size_t n, const KMeansReader& read, std::vector<size_t>& absorbed, unsigned iteration) {
+    size_t count = std::min(params.batch_size, n);
+    std::mt19937_64 rng(params.seed + iteration + 1);
+    std::uniform_int_distribution<size_t> draw(0, n - 1);
+    std::vector<size_t> rows(count);
+    for (size_t& row : rows) {
+        row = draw(rng);
+    }
+    std::sort(rows.begin(), rows.end());
+    std::vector<float> batch(count * dim);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (size_t p = 0; p < count; p++) {
+        read(rows[p], batch.data() + p * dim);
+    }
+    KMeansReader from_batch = [&](size_t p, float* out) {
+        std::memcpy(out, batch.data() + p * dim, dim * sizeof(float));
+    };
+
+    std::vector<int> labels(count);
+    double objective = assign(count, from_batch, 1, labels.data(), nullptr) / count;
+    std::vector<size_t> start(k + 1, 0);
+    for (size_t p = 0; p < count; p++) {
+        start[labels[p] + 1]++;
+    }
+    std::partial_sum(start.begin(), start.end(), start.begin());
+    std::vector<size_t> members(count);
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t p = 0; p < count; p++) {
+        members[fill[labels[p]]++] = p;
+    }
+    moveCentroids(members, start, from_batch, &absorbed);
+    return objective;
+}
+
+
+// Size-constrained rounds: every vector goes to its nearest centroid that
+// still has room, the vectors that lose most by moving choosing first, and
+// then the centroids move to the means of their vectors. A vector whose
+// candidates are all full takes the nearest centroid with room.
+void KMeans::balance(size_t n, const KMeansReader& read) {
+    const int candidates = std::min(BALANCE_CANDIDATES, k);
+    size_t capacity = std::max<size_t>(1, std::ceil(params.max_cluster_ratio * n / k));
+    std::vector<int> nearest_labels(n * candidates);
+    std::vector<float> nearest_scores(n * candidates);
+    std::vector<size_t> order(n);
+    std::vector<int> labels(n);
+    std::vector<size_t> sizes(k);
+    std::vector<float> x(dim);
+
+    for (int round = 0; round < BALANCE_ROUNDS; round++) {
+        assign(n, read, candidates, nearest_labels.data(), nearest_scores.data());
+        std::iota(order.begin(), order.end(), 0);
+        if (candidates > 1) {
+            auto regret = [&](size_t i) { return nearest_scores[i * candidates + 1] - nearest_scores[i * candidates]; };
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return regret(a) > regret(b); });
+        }
+        std::fill(sizes.begin(), sizes.end(), 0);
+        for (size_t i : order) {
+            int chosen = -1;
+            for (int j = 0; j < candidates && chosen < 0; j++) {
+                if (sizes[nearest_labels[i * candidates + j]] < capacity) {
+                    chosen = nearest_labels[i * candidates + j];
+                }
+            }
+            if (chosen < 0) {
+                read(i, x.data());
+                float best = std::numeric_limits<float>::max();
+                for (int c = 0; c < k; c++) {
+                    if (sizes[c] >= capacity) {
+                        continue;
+                    }
+                    float score = center_norms[c] - 2 * simdKernels().ip_float(reinterpret_cast<const char*>(x.data()),
+                        reinterpret_cast<const char*>(centers.data() + (size_t)c * dim), dim);
+                    if (score < best) {
+                        best = score;
+                        chosen = c;
+                    }
+                }
+            }
+            labels[i] = chosen;
+            sizes[chosen]++;
+        }
+
+        std::vector<size_t> start(k + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            start[labels[i] + 1]++;
+        }
+        std::partial_sum(start.begin(), start.end(), start.begin());
+        std::vector<size_t> members(n);
+        std::vector<size_t> fill(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            members[fill[labels[i]]++] = i;
+        }
+        moveCentroids(members, start, read, nullptr);
+    }
+}
+
+
+// The candidates nearest centroids of each of the n vectors, nearest first,
+// with their scores ||c||^2 - 2<x, c> when scores is set. Returns the summed
+// squared distances to the nearest centroids.
+double KMeans::assign(size_t n, const KMeansReader& read, int candidates, int* labels, float* scores) {
+    const size_t block = blockRows();
+    double total = 0;
+    #pragma omp parallel reduction(+ : total)
+    {
+        std::vector<float> x(block * dim);
+        std::vector<float> products(block * k);
+        #pragma omp for schedule(dynamic)
+        for (size_t first = 0; first < n; first += block) {
+            int count = std::min(block, n - first);
+            for (int r = 0; r < count; r++) {
+                read(first + r, x.data() + (size_t)r * dim);
+            }
+            total += nearest(x.data(), count, candidates, labels + first * candidates, scores ? scores + first * candidates : nullptr, products);
+        }
+    }
+    return total;
+}
+
+
+double KMeans::nearest(const float* x, int count, int candidates, int* labels, float* scores, std::vector<float>& block) {
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, count, k, dim, 1.0f, x, dim,
+                centers.data(), dim, 0.0f, block.data(), k);
+    std::vector<std::pair<float, int>> row(candidates > 1 ? k : 0);
+    double total = 0;
+    for (int r = 0; r < count; r++) {
+        const float* products = block.data() + (size_t)r * k;
+        const char* vector = reinterpret_cast<const char*>(x + (size_t)r * dim);
+        float vector_norm = simdKernels().ip_float(vector, vector, dim);
+        if (candidates == 1) {
+            float best = std::numeric_limits<float>::max();
+            int label = 0;
+            for (int c = 0; c < k; c++) {
+                float score = center_norms[c] - 2 * products[c];
+                if (score < best) {
+                    best = score;
+                    label = c;
+                }
+            }
+            labels[r] = label;
+            if (scores) {
+                scores[r] = best;
+            }
+            total += std::max(0.0f, vector_norm + best);
+            continue;
+        }
+        for (int c = 0; c < k; c++) {
+            row[c] = std::make_pair(center_norms[c] - 2 * products[c], c);
+        }
+        std::partial_sort(row.begin(), row.begin() + candidates, row.end());
+        for (int j = 0; j < candidates; j++) {
+            labels[(size_t)r * candidates + j] = row[j].second;
+            if (scores) {
+                scores[(size_t)r * candidates + j] = row[j].first;
+            }
+        }
+        total += std::max(0.0f, vector_norm + row[0].first);
+    }
+    return total;
+}
+
+
+// Moves every centroid to the mean of its members, or with absorbed set
+// (mini-batch) toward it with learning rate count / absorbed.
+void KMeans::moveCentroids(const std::vector<size_t>& members, const std::vector<size_t>& start, const KMeansReader& read,
+                           std::vector<size_t>* absorbed) {
+    std::vector<size_t> sizes(k);
+    #pragma omp parallel
+    {
+        std::vector<double> sum(dim);
+        std::vector<float> x(dim);
+        #pragma omp for schedule(dynamic, 16)
+        for (int c = 0; c < k; c++) {
+            size_t count = start[c + 1] - start[c];
+            sizes[c] = count;
+            if (count == 0) {
+                continue;
+            }
+            std::fill(sum.begin(), sum.end(), 0.0);
+            for (size_t p = start[c]; p < start[c + 1]; p++) {
+                read(members[p], x.data());
+                for (int d = 0; d < dim; d++) {
+                    sum[d] += x[d];
+                }
+            }
+            float* center = centers.data() + (size_t)c * dim;
+            if (absorbed) {
+                (*absorbed)[c] += count;
+                double rate = 1.0 / (*absorbed)[c];
+                for (int d = 0; d < dim; d++) {
+                    center[d] += rate * (sum[d] - count * (double)center[d]);
+                }
+            } else {
+                for (int d = 0; d < dim; d++) {
+                    center[d] = sum[d] / count;
+                }
+            }
+            if (params.spherical) {
+                normalizeVector(center, center, dim);
+            }
+        }
+    }
+    //a mini-batch leaves most centroids untouched, so only full passes split
+    if (!absorbed) {
+        training_stats.empty_clusters += splitEmptyClusters(sizes);
+    }
+    updateNorms();
+}
+
+
+// Gives every empty cluster half of the currently largest one: the two
+// centroids become copies of it nudged apart in opposite directions.
+size_t KMeans::splitEmptyClusters(std::vector<size_t>& sizes) {
+    size_t split = 0;
+    for (int c = 0; c < k; c++) {
+        if (sizes[c] > 0) {
+            continue;
+        }
+        int largest = std::max_element(sizes.begin(), sizes.end()) - sizes.begin();
+        if (sizes[largest] < 2) {
+            break;
+        }
+        split++;
+        float* from = centers.data() + (size_t)largest * dim;
+        float* to = centers.data() + (size_t)c * dim;
+        for (int d = 0; d < dim; d++) {
+            float sign = d % 2 == 0 ? 1.0f : -1.0f;
+            to[d] = from[d] * (1 + sign * SPLIT_EPS);
+            from[d] *= 1 - sign * SPLIT_EPS;
+        }
+        if (params.spherical) {
+            normalizeVector(to, to, dim);
+            normalizeVector(from, from, dim);
+        }
+        sizes[c] = sizes[largest] / 2;
+        sizes[largest] -= sizes[c];
+    }
+    return split;
+}
+
+
+void KMeans::updateNorms() {
+    center_norms.resize(k);
+    for (int c = 0; c < k; c++) {
+        const char* center = reinterpret_cast<const char*>(centers.data() + (size_t)c * dim);
+        center_norms[c] = simdKernels().ip_float(center, center, dim);
+    }
+}
+
+
+int KMeans::blockRows() const {
+    return std::max<size_t>(1, std::min<size_t>(MAX_BLOCK_ROWS, BLOCK_FLOATS / k));
+}
@@ -0,0 +1,118 @@
+#ifndef IVF_KMEANS_H
+#define IVF_KMEANS_H
+
+#include <cstddef>
+#include <functional>
+#include <random>
+#include <vector>
+
+
+// Writes training vector i (dim floats) to out. The trainer calls it from
+// several threads at once and may ask for a vector more than once per pass.
+using KMeansReader = std::function<void(size_t i, float* out)>;
+
+
+// How the initial centroids are picked: k distinct random training vectors,
+// k-means++ (Arthur and Vassilvitskii, one pass over the training set per
+// centroid), or k-means|| (Bahmani et al.), which oversamples about k
+// candidates per pass for PARALLEL_ROUNDS passes and reduces them to k with
+// weighted k-means++.
+enum class KMeansSeeding { RANDOM, PLUS_PLUS, PARALLEL };
+
+
+// Options of the k-means trainer. batch_size > 0 replaces the Lloyd passes
+// over the whole training set with mini-batch k-means (Sculley, 2010): every
+// iteration then draws batch_size vectors at random, assigns them, and moves
+// each centroid toward the mean of its share with a learning rate of one over
+// the vectors it has absorbed so far, so iterations count batches, not
+// passes. spherical keeps the centroids on the unit sphere. max_cluster_ratio
+// > 0 ends training with size-constrained rounds that keep every cluster
+// under that many times the average size. tolerance > 0 stops before
+// iterations once one improves the objective by less than that fraction
+// (mini-batch objectives are smoothed over batches first).
+// hierarchical trains in two levels for large k: about sqrt(k) groups
+// first, then every group on its own into its share of the k centroids
+// (proportional to its size), the groups in parallel. Each level runs the
+// options above, so a pass costs O(n sqrt(k) d) instead of O(n k d).
+// refine_iterations full Lloyd passes over all k centroids may follow.
+// With more than max_points_per_centroid * k training vectors, train() uses
+// a uniform sample of that many instead (0 uses them all), as faiss does.
+struct KMeansParameters {
+    int iterations = 20;
+    KMeansSeeding seeding = KMeansSeeding::RANDOM;
+    float tolerance = 0;
+    size_t batch_size = 0;
+    bool spherical = false;
+    float max_cluster_ratio = 0;
+    bool hierarchical = false;
+    int refine_iterations = 0;
+    size_t max_points_per_centroid = 256;
+    unsigned seed = 1234;
+};
+
+
+// What the last train() did. objective holds the mean squared distance of
+// each iteration's assignment (of its batch in mini-batch mode).
+// empty_clusters counts the clusters split for coming out empty, or in
+// mini-batch mode the centroids that never absorbed a vector. Hierarchical
+// training reports the grouped result as the first objective, measured
+// within the groups and so an upper bound, followed by the refinement
+// passes, which are its iterations; empty clusters are summed over both
+// levels.
+struct KMeansStats {
+    size_t points = 0;   // training vectors used, after subsampling
+    int iterations = 0;
+    std::vector<double> objective;
+    size_t empty_clusters = 0;
+    double seconds = 0;
+};
+
+
+// k-means over vectors fetched through a reader, so the training set is never
+// copied as a whole. Assignment scores blocks of vectors against all
+// centroids with one sgemm each under OpenMP, and the update splits the
+// centroids between the threads. An empty cluster takes over half of the
+// largest one.
+class KMeans {
+    public:
+        KMeans(int dim, int k, const KMeansParameters& p = KMeansParameters());
+
+        void train(size_t n, const KMeansReader& read);
+
+        // k rows of dim floats.
+        const std::vector<float>& centroids() const {
+            return centers;
+        }
+
+        const KMeansStats& stats() const {
+            return training_stats;
+        }
+
+    private:
+        void iterate(size_t n, const KMeansReader& read);
+        void trainHierarchical(size_t n, const KMeansReader& read);
+        void seed(size_t n, const KMeansReader& read);
+        void seedParallel(size_t n, const KMeansReader& read, std::mt19937_64& rng);
+        void plusPlus(size_t n, const KMeansReader& read, const float* weights, int count, std::mt19937_64& rng, float* out);
+        void lowerDistances(size_t n, const KMeansReader& read, const float* new_centers, int count, std::vector<float>& distances);
+        double lloydIteration(size_t n, const KMeansReader& read);
+        double miniBatchIteration(size_t n, const KMeansReader& read, std::vector<size_t>& absorbed, unsigned iteration);
+        void balance(size_t n, const KMeansReader& read);
+        double assign(size_t n, const KMeansReader& read, int candidates, int* labels, float* scores);
+        double nearest(const float* x, int count, int candidates, int* labels, float* scores, std::vector<float>& block);
+        void moveCentroids(const std::vector<size_t>& members, const std::vector<size_t>& start, const KMeansReader& read,
+                           std::vector<size_t>* absorbed);
+        size_t splitEmptyClusters(std::vector<size_t>& sizes);
+        void updateNorms();
+        int blockRows() const;
+
+        int dim;
+        int k;
+        KMeansParameters params;
+        std::vector<float> centers;
+        std::vector<float> center_norms;   // ||c||^2, for the sgemm scores
+        KMeansStats training_stats;
+};
+
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef IVF_METRIC_H
+#define IVF_METRIC_H
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+
+// What the indexes rank by. IP and COSINE return the largest inner products
+// first. Internally they keep -<q, x> as the distance, so the same
+// smallest-first top-k and probe order serve every metric. COSINE normalises
+// the vectors at add() and query() time, after which it is plain IP.
+enum class Metric { L2, IP, COSINE };
+
+
+// Parses the harness spelling: L2, IP or cosine.
+inline Metric metricFromName(const std::string& name) {
+    if (name == "L2") {
+        return Metric::L2;
+    }
+    if (name == "IP") {
+        return Metric::IP;
+    }
+    if (name == "cosine") {
+        return Metric::COSINE;
+    }
+    throw std::invalid_argument("unknown distance function: " + name);
+}
+
+
+// Writes v scaled to unit length to out (which may be v). A zero vector is
+// copied unchanged.
+inline void normalizeVector(const float* v, float* out, int dim) {
+    double norm = 0;
+    for (int j = 0; j < dim; j++) {
+        norm += (double)v[j] * v[j];
+    }
+    float scale = norm > 0 ? (float)(1.0 / std::sqrt(norm)) : 1.0f;
+    for (int j = 0; j < dim; j++) {
+        out[j] = v[j] * scale;
+    }
+}
+
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef IVF_PROXIMITY_GRAPH_H
+#define IVF_PROXIMITY_GRAPH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+
+// Single-layer navigable graph in the style of Vamana (DiskANN). Every node
+// keeps at most degree out-edges chosen by robust pruning, and searches walk
+// greedily from an entry node with a bounded beam. Distances come from
+// callbacks, so one graph type serves any vector format: build() takes
+// distance(a, b) between two nodes, search() takes distance(node) to the query.
+// alpha applies to the distances as the callback returns them (squared L2
+// for the indexes, so 1.2 there is about 1.1 on plain distances).
+class ProximityGraph {
+    public:
+        ProximityGraph() = default;
+        ProximityGraph(int degree, int build_beam, float alpha = 1.2f)
+            : degree(degree), build_beam(std::max(build_beam, degree)), alpha(alpha) {}
+
+        // Builds the graph over nodes [0, n) in two passes, the first with
+        // alpha 1 for short edges and the second with alpha for long ones.
+        template <typename Distance>
+        void build(int n, int entry_node, Distance distance) {
+            entry = entry_node;
+            neighbours.assign(n, {});
+            std::mt19937 rng(1234);
+            int initial = std::min(degree, n - 1);
+            for (int node = 0; node < n; node++) {
+                while ((int)neighbours[node].size() < initial) {
+                    int other = rng() % n;
+                    if (other != node && std::find(neighbours[node].begin(), neighbours[node].end(), other) == neighbours[node].end()) {
+                        neighbours[node].push_back(other);
+                    }
+                }
+            }
+            std::vector<int> order(n);
+            std::iota(order.begin(), order.end(), 0);
+            std::shuffle(order.begin(), order.end(), rng);
+
+            std::vector<std::pair<float, int>> candidates;
+            for (float pass_alpha : {1.0f, alpha}) {
+                for (int node : order) {
+                    search([&](int other) { return distance(node, other); }, build_beam, candidates);
+                    for (int other : neighbours[node]) {
+                        candidates.emplace_back(distance(node, other), other);
+                    }
+                    robustPrune(node, candidates, pass_alpha, distance);
+                    for (int other : neighbours[node]) {
+                        std::vector<int>& back = neighbours[other];
+                        if (std::find(back.begin(), back.end(), node) != back.end()) {
+                            continue;
+                        }
+                        back.push_back(node);
+                        if ((int)back.size() > degree) {
+                            std::vector<std::pair<float, int>> edges;
+                            for (int target : back) {
+                                edges.emplace_back(distance(other, target), target);
+                            }
+                            robustPrune(other, edges, pass_alpha, distance);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Beam search from the entry node. results gets the (distance, node)
+        // pairs of the up to beam closest nodes found, nearest first.
+        template <typename Distance>
+        void search(Distance distance, int beam, std::vector<std::pair<float, int>>& results) const {
+            results.clear();
+            if (neighbours.empty()) {
+                return;
+            }
+            //visited flags are kept per thread and reset through touched after each search
+            thread_local std::vector<uint8_t> visited;
+            if (visited.size() < neighbours.size()) {
+                visited.resize(neighbours.size(), 0);
+            }
+            std::vector<int> touched;
+            std::vector<bool> expanded;
+            size_t next = 0;   // first entry that may not be expanded yet
+            auto insert = [&](float d, int node) {
+                if ((int)results.size() == beam && d >= results.back().first) {
+                    return;
+                }
+                auto position = std::upper_bound(results.begin(), results.end(), std::make_pair(d, node));
+                size_t slot = position - results.begin();
+                results.insert(position, std::make_pair(d, node));
+                expanded.insert(expanded.begin() + slot, false);
+                next = std::min(next, slot);
+                if ((int)results.size() > beam) {
+                    results.pop_back();
+                    expanded.pop_back();
+                }
+            };
+            visited[entry] = 1;
+            touched.push_back(entry);
+            insert(distance(entry), entry);
+            while (next < results.size()) {
+                if (expanded[next]) {
+                    next++;
+                    continue;
+                }
+                expanded[next] = true;
+                int node = results[next].second;
+                for (int other : neighbours[node]) {
+                    if (visited[other]) {
+                        continue;
+                    }
+                    visited[other] = 1;
+                    touched.push_back(other);
+                    insert(distance(other), other);
+                }
+            }
+            for (int node : touched) {
+                visited[node] = 0;
+            }
+        }
+
+        bool empty() const {
+            return neighbours.empty();
+        }
+
+        size_t edges() const {
+            size_t count = 0;
+            for (const auto& out : neighbours) {
+                count += out.size();
+            }
+            return count;
+        }
+
+    private:
+        // Keeps the closest candidates that are not already covered: c is
+        // dropped when a kept neighbour r has alpha * d(r, c) <= d(node, c).
+        template <typename Distance>
+        void robustPrune(int node, std::vector<std::pair<float, int>>& candidates, float prune_alpha, Distance distance) {
+            std::sort(candidates.begin(), candidates.end());
+            std::vector<int> kept;
+            int last = -1;
+            for (const auto& [d, candidate] : candidates) {
+                if ((int)kept.size() == degree) {
+                    break;
+                }
+                if (candidate == node || candidate == last) {
+                    continue;
+                }
+                last = candidate;
+                bool covered = false;
+                for (int r : kept) {
+                    if (r == candidate || prune_alpha * distance(r, candidate) <= d) {
+                        covered = true;
+                        break;
+                    }
+                }
+                if (!covered) {
+                    kept.push_back(candidate);
+                }
+            }
+            neighbours[node] = std::move(kept);
+        }
+
+        int degree = 32;
+        int build_beam = 64;
+        float alpha = 1.2f;
+        int entry = 0;
+        std::vector<std::vector<int>> neighbours;
+};
+
+
+#endif
@@ -0,0 +1,113 @@
+#include "quantizer_cache.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ull;
+static const uint64_t FNV_PRIME = 1099511628211ull;
+
+// Bumped whenever training or the entry format changes, which retires every
+// entry written before.
+static const uint32_t CACHE_VERSION = 2;
+static const uint32_t CACHE_MAGIC = 0x51434956;   // "IVCQ"
+
+
+CacheKey::CacheKey(const std::string& kind) : kind(kind), hash(FNV_OFFSET) {
+    add(CACHE_VERSION);
+    add(kind.data(), kind.size());
+}
+
+
+CacheKey& CacheKey::add(const void* data, size_t bytes) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; i++) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    }
+    return *this;
+}
+
+
+CacheKey& CacheKey::add(const KMeansParameters& p) {
+    add(p.iterations).add(p.seeding).add(p.tolerance).add(p.batch_size);
+    add(p.spherical).add(p.max_cluster_ratio).add(p.hierarchical).add(p.refine_iterations);
+    return add(p.max_points_per_centroid).add(p.seed);
+}
+
+
+CacheKey& CacheKey::addDataset(const std::shared_ptr<ANNS::IStorage>& dataset, ElementType type, int dim) {
+    uint64_t n = dataset->get_num_points();
+    add(n).add(type).add(dim);
+    size_t row_bytes = dim * elementSize(type);
+    for (uint64_t i = 0; i < n; i++) {
+        add(dataset->get_vector(i), row_bytes);
+    }
+    return *this;
+}
+
+
+std::string CacheKey::name() const {
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return kind + "-" + hex + ".bin";
+}
+
+
+std::string QuantizerCache::path(const CacheKey& key) const {
+    return (std::filesystem::path(directory) / key.name()).string();
+}
+
+
+bool QuantizerCache::load(const CacheKey& key, const std::vector<size_t>& sizes, std::vector<std::vector<float>>& arrays) const {
+    std::string file = path(key);
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    uint32_t magic = 0, count = 0;
+    in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    in.read(reinterpret_cast<char*>(&count), sizeof(count));
+    //a truncated, foreign or stale entry is a miss; train() retrains and save() replaces it
+    if (!in || magic != CACHE_MAGIC || count != sizes.size()) {
+        return false;
+    }
+    arrays.resize(count);
+    for (uint32_t a = 0; a < count; a++) {
+        uint64_t length = 0;
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if (!in || length != sizes[a]) {
+            return false;
+        }
+        arrays[a].resize(length);
+        in.read(reinterpret_cast<char*>(arrays[a].data()), length * sizeof(float));
+    }
+    return (bool)in;
+}
+
+
+void QuantizerCache::save(const CacheKey& key, const std::vector<std::vector<float>>& arrays) const {
+    std::filesystem::create_directories(directory);
+    std::string file = path(key);
+    //a random suffix keeps concurrent writers of the same key apart
+    std::string partial = file + ".tmp" + std::to_string(std::random_device()());
+    {
+        std::ofstream out(partial, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("cannot write quantizer cache entry " + partial);
+        }
+        uint32_t count = arrays.size();
+        out.write(reinterpret_cast<const char*>(&CACHE_MAGIC), sizeof(CACHE_MAGIC));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const auto& values : arrays) {
+            uint64_t length = values.size();
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out.write(reinterpret_cast<const char*>(values.data()), length * sizeof(float));
+        }
+        if (!out) {
+            throw std::runtime_error("cannot write quantizer cache entry " + partial);
+        }
+    }
+    std::filesystem::rename(partial, file);
+}
@@ -0,0 +1,66 @@
+#ifndef IVF_QUANTIZER_CACHE_H
+#define IVF_QUANTIZER_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "../../include/storage.h"
+#include "element_type.h"
+#include "kmeans.h"
+
+
+// 64-bit FNV-1a hash of everything a trained quantizer depends on: the index
+// kind, its options and the content of the training set. Two trainings with
+// equal keys would produce the same result, so the second can load the first.
+class CacheKey {
+    public:
+        explicit CacheKey(const std::string& kind);
+
+        CacheKey& add(const void* data, size_t bytes);
+
+        template <typename T>
+        CacheKey& add(const T& value) {
+            static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "hash structs field by field");
+            return add(&value, sizeof(T));
+        }
+
+        // Every option of the trainer, field by field.
+        CacheKey& add(const KMeansParameters& p);
+
+        // Size and raw vector bytes of the dataset, one pass over it.
+        CacheKey& addDataset(const std::shared_ptr<ANNS::IStorage>& dataset, ElementType type, int dim);
+
+        // File name of the entry, kind followed by the hash in hex.
+        std::string name() const;
+
+    private:
+        std::string kind;
+        uint64_t hash;
+};
+
+
+// Trained quantizers kept on disk as one file per key in directory, holding
+// float arrays with their lengths. An entry is written under a temporary
+// name and renamed into place, so concurrent runs never read a partial one.
+class QuantizerCache {
+    public:
+        explicit QuantizerCache(const std::string& directory) : directory(directory) {}
+
+        // Fills arrays from the entry for key and returns true, or returns
+        // false when there is none or it does not hold sizes.size() arrays
+        // of exactly those lengths (truncated or stale entries), so a broken
+        // cache only costs a retraining. arrays is unspecified after a miss.
+        bool load(const CacheKey& key, const std::vector<size_t>& sizes, std::vector<std::vector<float>>& arrays) const;
+
+        void save(const CacheKey& key, const std::vector<std::vector<float>>& arrays) const;
+
+        std::string path(const CacheKey& key) const;
+
+    private:
+        std::string directory;
+};
+
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef IVF_RESERVOIR_SAMPLER_H
+#define IVF_RESERVOIR_SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Uniform fixed-size sample of a stream of equally sized rows, in one pass
+// and memory for the sample only. Uses Li's Algorithm L, which knows ahead
+// which row the sample takes next, so a seekable source can skip the rows in
+// between unread: a sample of k out of N reads about k * (1 + ln(N / k)) rows.
+// For every row i of the stream, call take() when i == next().
+class ReservoirSampler {
+    public:
+        ReservoirSampler(size_t capacity, size_t row_bytes, unsigned seed = 1234)
+            : capacity(capacity), row_bytes(row_bytes), rng(seed) {
+            if (capacity == 0 || row_bytes == 0) {
+                throw std::invalid_argument("the reservoir needs room for at least one row");
+            }
+            rows.reserve(capacity * row_bytes);
+            weight = std::exp(std::log(uniform()) / capacity);
+        }
+
+        // Stream position of the next row the sample takes.
+        size_t next() const {
+            return next_row;
+        }
+
+        // Takes row next() of the stream into the sample.
+        void take(const char* row) {
+            if (size() < capacity) {
+                rows.insert(rows.end(), row, row + row_bytes);
+                next_row++;
+                if (size() == capacity) {
+                    advance();
+                }
+                return;
+            }
+            size_t slot = std::uniform_int_distribution<size_t>(0, capacity - 1)(rng);
+            std::memcpy(rows.data() + slot * row_bytes, row, row_bytes);
+            weight *= std::exp(std::log(uniform()) / capacity);
+            next_row++;
+            advance();
+        }
+
+        size_t size() const {
+            return rows.size() / row_bytes;
+        }
+
+        // The sampled rows back to back, in no particular order.
+        const std::vector<char>& data() const {
+            return rows;
+        }
+
+    private:
+        double uniform() {
+            //open interval, both logs need a non-zero argument
+            double u;
+            do {
+                u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+            } while (u <= 0.0);
+            return u;
+        }
+
+        void advance() {
+            double skip = std::floor(std::log(uniform()) / std::log1p(-weight));
+            next_row += skip < (double)SIZE_MAX / 2 ? (size_t)skip : SIZE_MAX / 2;
+        }
+
+        size_t capacity;
+        size_t row_bytes;
+        std::mt19937_64 rng;
+        double weight;
+        size_t next_row = 0;
+        std::vector<char> rows;
+};
+
+
+// Writes a uniform sample of up to sample_size vectors of the .bin file at
+// input (uint32 count, uint32 dim, then the vectors row after row) to output
+// in the same format, seeking past the rows the sampler skips. Memory holds
+// the sample only, so the input can be far larger than RAM; the training
+// storage is then loaded from output.
+inline size_t sampleBinFile(const std::string& input, const std::string& output, size_t element_size, size_t sample_size,
+                            unsigned seed = 1234) {
+    std::ifstream in(input, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot read " + input);
+    }
+    uint32_t num_points = 0, dim = 0;
+    in.read(reinterpret_cast<char*>(&num_points), sizeof(num_points));
+    in.read(reinterpret_cast<char*>(&dim), sizeof(dim));
+    if (!in || dim == 0) {
+        throw std::runtime_error("corrupt vector file " + input);
+    }
+    size_t row_bytes = dim * element_size;
+    const std::streamoff header = 2 * sizeof(uint32_t);
+    ReservoirSampler sampler(std::max<size_t>(1, std::min<size_t>(sample_size, num_points)), row_bytes, seed);
+    std::vector<char> row(row_bytes);
+    while (sampler.next() < num_points) {
+        in.seekg(header + (std::streamoff)sampler.next() * row_bytes);
+        if (!in.read(row.data(), row_bytes)) {
+            throw std::runtime_error("truncated vector file " + input);
+        }
+        sampler.take(row.data());
+    }
+
+    std::ofstream out(output, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("cannot write " + output);
+    }
+    uint32_t count = sampler.size();
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+    out.write(sampler.data().data(), sampler.data().size());
+    if (!out) {
+        throw std::runtime_error("cannot write " + output);
+    }
+    return count;
+}
+
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef IVF_TOPK_H
+#define IVF_TOPK_H
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "../../include/storage.h"
+#include "kernels.h"
+
+
+// Keeps the k smallest (distance, id) pairs seen so far in a max-heap, so the
+// current k-th distance is always at hand as a pruning threshold. With
+// distinct set, an id already in the heap is not pushed again; only
+// candidates that beat the threshold pay for the O(k) check.
+class TopK {
+    public:
+        explicit TopK(int k, bool distinct = false) : k(k), distinct(distinct) {
+            heap.reserve(k);
+        }
+
+        // Distance a candidate has to beat to enter the top-k.
+        float threshold() const {
+            return (int)heap.size() < k ? std::numeric_limits<float>::max() : heap.front().first;
+        }
+
+        int size() const {
+            return heap.size();
+        }
+
+        int capacity() const {
+            return k;
+        }
+
+        bool full() const {
+            return (int)heap.size() == k;
+        }
+
+        // Smallest distance kept, the largest float while empty.
+        float best() const {
+            float distance = std::numeric_limits<float>::max();
+            for (const auto& entry : heap) {
+                distance = std::min(distance, entry.first);
+            }
+            return distance;
+        }
+
+        // Candidates that have entered the top-k so far; comparing two
+        // readings tells whether a scan changed it.
+        size_t insertions() const {
+            return inserted;
+        }
+
+        void push(float distance, int id) {
+            if ((int)heap.size() == k && !(distance < heap.front().first)) {
+                return;
+            }
+            if (distinct && contains(id)) {
+                return;
+            }
+            if ((int)heap.size() < k) {
+                heap.emplace_back(distance, id);
+                std::push_heap(heap.begin(), heap.end());
+                inserted++;
+            } else {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = {distance, id};
+                std::push_heap(heap.begin(), heap.end());
+                inserted++;
+            }
+        }
+
+        // Pushes a block of candidates; the SIMD filter drops the ones that
+        // cannot beat the current threshold before they reach the heap.
+        void push(const float* distances, const int* ids, int n) {
+            positions.resize(n);
+            int passed = simdKernels().filter_below(distances, n, threshold(), positions.data());
+            for (int p = 0; p < passed; p++) {
+                push(distances[positions[p]], ids[positions[p]]);
+            }
+        }
+
+        // Writes the results by increasing distance. Slots left when fewer
+        // than k candidates were seen get id -1 and the largest float.
+        // negate reports -distance instead, which turns the -<q, x> kept for
+        // IP and cosine back into similarities (missing slots get -max).
+        void extract(std::pair<ANNS::IdxType, float>* results, bool negate = false) {
+            std::sort_heap(heap.begin(), heap.end());
+            float sign = negate ? -1.0f : 1.0f;
+            for (int j = 0; j < k; j++) {
+                if (j < (int)heap.size()) {
+                    results[j] = {(ANNS::IdxType)heap[j].second, sign * heap[j].first};
+                } else {
+                    results[j] = {(ANNS::IdxType)-1, sign * std::numeric_limits<float>::max()};
+                }
+            }
+            heap.clear();
+        }
+
+    private:
+        bool contains(int id) const {
+            for (const auto& entry : heap) {
+                if (entry.second == id) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        int k;
+        bool distinct;
+        size_t inserted = 0;
+        std::vector<std::pair<float, int>> heap;
+        std::vector<int> positions;
+};
+
+
+#endif
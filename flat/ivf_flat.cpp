@@ -1,19 +1,86 @@
 #include "ivf_flat.h"
-#include "../../include/distance.h"
+#include "../common/kernels.h"
+#include "../common/element_type.h"
+#include "../common/topk.h"
 #include <cmath> 
+#include <limits>
 #include <random>
 #include <algorithm>  // for std::shuffle
-#include <queue> 
-#include <faiss/Clustering.h>
-#include <faiss/IndexFlat.h>  // needed as a temporary quantizer
+#include <numeric>
+#include <cstring>
+#include <stdexcept>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <cblas.h>
+#include "../common/bounded_queue.h"
+#include "../common/proximity_graph.h"
 
 using namespace std;
 using namespace ANNS;  
 
+using Pair = std::pair<float, int>;
+
 
-IndexIVFFlat::IndexIVFFlat(int d, int np, int nl) : dim(d), nprobe(np), nlist(nl) {
+IndexIVFFlat::IndexIVFFlat(int d, int np, int nl, const IVFFlatParameters& p) : dim(d), nprobe(np), nlist(nl), params(p) {
     inverted_list.resize(nlist); 
     centroids.resize(nlist); 
+    code_size = dim * (params.precision == ListPrecision::FP32 ? sizeof(float) : sizeof(uint16_t)); 
+    if (params.layout == ListLayout::TILED && params.precision != ListPrecision::FP32) {
+        throw std::invalid_argument("the tiled list layout needs FP32 precision"); 
+    }
+    if (params.early_abandon && (params.layout != ListLayout::ROWS || params.precision != ListPrecision::FP32 || params.store_norms)) {
+        throw std::invalid_argument("early abandoning needs FP32 row lists without stored norms"); 
+    }
+    if (params.early_abandon && params.metric != Metric::L2) {
+        throw std::invalid_argument("early abandoning needs the L2 metric"); 
+    }
+    if ((params.batch_by_list ? 1 : 0) + (params.interleave > 1 ? 1 : 0) + (params.pipeline_threads > 0 ? 1 : 0) > 1) {
+        throw std::invalid_argument("batch_by_list, interleave and pipeline_threads are separate search modes"); 
+    }
+    if (params.list_graph_threshold > 0 && params.layout != ListLayout::ROWS) {
+        throw std::invalid_argument("list graphs need the row layout"); 
+    }
+    if (params.probe_ratio > 0 && params.metric != Metric::L2) {
+        throw std::invalid_argument("probe_ratio compares squared L2 distances and needs the L2 metric"); 
+    }
+    if (params.min_nprobe < 1 || (params.max_nprobe > 0 && params.min_nprobe > params.max_nprobe)) {
+        throw std::invalid_argument("min_nprobe must be between 1 and max_nprobe"); 
+    }
+    if (params.spill < 1 || params.soar_lambda < 0) {
+        throw std::invalid_argument("spill must be at least 1 and soar_lambda not negative"); 
+    }
+    if ((params.max_list_ratio != 0 && params.max_list_ratio < 1) || (params.cap_lists && params.max_list_ratio == 0)) {
+        throw std::invalid_argument("max_list_ratio must be at least 1, and cap_lists needs it set"); 
+    }
+    list_codes.resize(params.layout == ListLayout::ROWS ? nlist : 0); 
+    list_tiles.resize(params.layout == ListLayout::TILED ? nlist : 0); 
+    list_norms.resize(nlist); 
+    list_radii.assign(nlist, 0.0f); 
+    member_distances.resize(params.sort_lists ? nlist : 0); 
+    list_graphs.resize(nlist); 
+    padded_dim = tilePaddedDim(dim); 
+
+    //kernels are picked once here instead of per distance call
+    l2_kernel = selectL2Kernel(dim); 
+    centroid_ip_kernel = simdKernels().ip_float; 
+    bool inner_products = params.store_norms || params.metric != Metric::L2; 
+    tile_kernel = inner_products ? simdKernels().ip_tile : simdKernels().l2_tile; 
+    early_abandon_kernel = simdKernels().l2_early_abandon; 
+    ip_block_kernel = simdKernels().ip_block; 
+    switch (params.precision) {
+        case ListPrecision::FP16:
+            list_kernel = simdKernels().l2_fp16; 
+            ip_kernel = simdKernels().ip_fp16; 
+            break; 
+        case ListPrecision::BF16:
+            list_kernel = simdKernels().l2_bf16; 
+            ip_kernel = simdKernels().ip_bf16; 
+            break; 
+        default:
+            list_kernel = l2_kernel; 
+            ip_kernel = simdKernels().ip_float; 
+    }
 }
 
 
@@ -31,111 +98,1297 @@ void printVector(const vector<float>& vec) {
 void IndexIVFFlat::train(std::shared_ptr<IStorage> dataset) {
     //perform k means clustering 
 
-    auto float_storage = std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset);
-
-    faiss::ClusteringParameters cp; 
-    cp.verbose = false; 
-    cp.niter = 20; 
-    faiss::Clustering clus(dim, nlist, cp);
-    faiss::IndexFlatL2 quantizer(dim);
-    vector<float> data; 
-    data.reserve(float_storage->get_num_points()); 
-    for(int i = 0; i < float_storage->get_num_points(); i++) {
-        float* v = reinterpret_cast<float*>(float_storage->get_vector(i));
-        data.insert(data.end(), v, v + dim);
+    //byte datasets are stored natively, the precision only applies to float data
+    element_type = elementType(dataset); 
+    if (element_type != ElementType::FLOAT && params.layout == ListLayout::TILED) {
+        throw std::invalid_argument("the tiled list layout needs a float dataset"); 
+    }
+    if (element_type != ElementType::FLOAT && params.early_abandon) {
+        throw std::invalid_argument("early abandoning needs a float dataset"); 
+    }
+    if (element_type != ElementType::FLOAT && params.metric == Metric::COSINE) {
+        throw std::invalid_argument("the cosine metric needs a float dataset"); 
+    }
+    if (element_type != ElementType::FLOAT) {
+        code_size = dim * elementSize(element_type); 
+        list_kernel = element_type == ElementType::INT8 ? simdKernels().l2_int8 : simdKernels().l2_uint8; 
+        ip_kernel = element_type == ElementType::INT8 ? simdKernels().ip_int8 : simdKernels().ip_uint8; 
     }
-    
-    clus.train(float_storage->get_num_points(), data.data(), quantizer);
 
+    //IP and cosine cluster on the unit sphere, ranking centroids by inner product
+    KMeansParameters kp = params.kmeans; 
+    kp.spherical = params.metric != Metric::L2; 
+    kp.max_cluster_ratio = params.max_list_ratio; 
+    KMeansReader read = [&](size_t i, float* out) {
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, out); 
+        if (params.metric == Metric::COSINE) {
+            normalizeVector(v, out, dim); 
+        } else if (v != out) {
+            std::memcpy(out, v, dim * sizeof(float)); 
+        }
+    }; 
+
+    //the key covers everything the centroids depend on; the metric is hashed on its own since
+    //spherical does not tell IP from cosine, which alone normalizes the training vectors
+    QuantizerCache cache(params.cache_dir); 
+    CacheKey key("ivf_flat"); 
+    vector<vector<float>> entry; 
+    cache_hit = false; 
+    if (!params.cache_dir.empty()) {
+        key.add(dim).add(nlist).add(params.metric).add(kp).addDataset(dataset, element_type, dim); 
+        cache_hit = cache.load(key, {(size_t)nlist * dim}, entry); 
+    }
+    if (cache_hit) {
+        training_stats = KMeansStats(); 
+    } else {
+        KMeans clustering(dim, nlist, kp); 
+        clustering.train(dataset->get_num_points(), read); 
+        training_stats = clustering.stats(); 
+        entry = {clustering.centroids()}; 
+        if (!params.cache_dir.empty()) {
+            cache.save(key, entry); 
+        }
+    }
+    if (params.early_abandon && params.permute_dims) {
+        orderDimsByVariance(dataset->get_num_points(), read); 
+    }
 
-    centroids = convertToVectorOfVectors(clus.centroids.data(), nlist, dim); 
+    const vector<float>& trained = entry[0]; 
+    centroids = convertToVectorOfVectors(trained.data(), nlist, dim); 
+    centroid_matrix.assign(trained.begin(), trained.end()); 
+    centroid_norms.resize(nlist); 
+    for (int j = 0; j < nlist; j++) {
+        centroid_norms[j] = centroid_ip_kernel(reinterpret_cast<const char *>(centroids[j].data()), reinterpret_cast<const char *>(centroids[j].data()), dim); 
+    }
+    if (params.coarse_graph_degree > 0) {
+        buildCoarseGraph(); 
+    }
     std::cout << "centroids" << centroids.size() << std::endl;
 
 }
 
 
 void IndexIVFFlat::add(std::shared_ptr<IStorage> dataset) {
-    auto float_storage = std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset);
-    base_storage.reserve(float_storage->get_num_points());
-    for(int i = 0; i < float_storage->get_num_points(); i++) {
-        int best_index = 0; 
-        float* v = reinterpret_cast<float*>(float_storage->get_vector(i));
-        float best_distance = euclideanDistance(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[0].data())); 
-        for(int j = 1; j < centroids.size(); j++) {
-            float distance = euclideanDistance(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[j].data())); 
-            if(distance < best_distance) {
-                best_distance = distance; 
-                best_index = j; 
+    checkElementType(dataset); 
+    vector<float> buffer(dim); 
+    vector<float> permuted(dim); 
+    vector<float> normalized(dim); 
+    vector<float> decoded(dim); 
+    vector<char> code(code_size); 
+    vector<bool> grown(nlist, false); 
+    vector<Pair> ranked; 
+    vector<int> assigned; 
+    //lists may not grow past max_list_ratio times the average size this add() ends with
+    if (params.cap_lists) {
+        size_t entries = numEntries() + (size_t)dataset->get_num_points() * std::min(params.spill, nlist); 
+        list_cap = std::max<size_t>(1, std::ceil(params.max_list_ratio * entries / nlist)); 
+    }
+    for(int i = 0; i < dataset->get_num_points(); i++) {
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, buffer.data());
+        if (params.metric == Metric::COSINE) {
+            normalizeVector(v, normalized.data(), dim); 
+            v = normalized.data(); 
+        }
+        assignLists(v, ranked, assigned); 
+
+        //the centroids stay in input order, only the list copies are permuted
+        const float* stored = permuteDims(v, permuted.data()); 
+        if (params.layout == ListLayout::ROWS) {
+            if (element_type == ElementType::FLOAT) {
+                encodeVector(stored, code.data()); 
+            } else {
+                std::memcpy(code.data(), dataset->get_vector(i), code_size); 
             }
         }
+        for (int list : assigned) {
+            float radius = centroidRadius(v, list, decoded.data()); 
+            list_radii[list] = std::max(list_radii[list], radius); 
+            if (params.sort_lists) {
+                member_distances[list].push_back(radius); 
+            }
+            grown[list] = true; 
 
-        base_storage.emplace_back(v, v + dim); 
+            if (params.layout == ListLayout::TILED) {
+                appendToTiles(list, stored); 
+            } else {
+                list_codes[list].insert(list_codes[list].end(), code.begin(), code.end()); 
+            }
+            if (usesNorms()) {
+                list_norms[list].push_back(storedNorm(stored, code.data())); 
+            }
 
- 
+            inverted_list[list].push_back(i); 
+        }
+        num_vectors++; 
+    }
 
-        inverted_list[best_index].push_back(i); 
+    vector<int> oversized; 
+    for (int list = 0; list < nlist; list++) {
+        if (grown[list] && params.sort_lists) {
+            sortList(list); 
+        }
+        if (grown[list] && params.list_graph_threshold > 0 && inverted_list[list].size() > (size_t)params.list_graph_threshold) {
+            oversized.push_back(list); 
+        }
+    }
+    //the graphs are independent, one list per thread
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t j = 0; j < oversized.size(); j++) {
+        buildListGraph(oversized[j]); 
     }
 }
 
 
-using Pair = std::pair<float, int>;
+void IndexIVFFlat::query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
+    checkElementType(dataset); 
+    if (params.batch_by_list) {
+        queryByList(dataset, k, results); 
+        return; 
+    }
+    if (params.interleave > 1) {
+        queryInterleaved(dataset, k, results); 
+        return; 
+    }
+    if (params.pipeline_threads > 0) {
+        queryPipelined(dataset, k, results); 
+        return; 
+    }
+    std::pair<IdxType, float>* _results = results; 
+    vector<float> distances; 
+    vector<float> scan_vector(dim); 
+    vector<float> padded_query(padded_dim, 0.0f); 
+    vector<Pair> ranked(nlist); 
+    vector<int> probed; 
+    vector<float> probe_distances; 
+    for(int i = 0; i < dataset->get_num_points(); i++) {
+        float query_norm; 
+        prepareQuery(dataset, i, k, ranked, probed, probe_distances, scan_vector.data(), padded_query.data(), query_norm); 
+        //byte lists are scanned against the raw query bytes
+        const char* scan_query = element_type == ElementType::FLOAT ? reinterpret_cast<const char *>(scan_vector.data()) : dataset->get_vector(i); 
+
+        TopK actual_vectors(k, spilled()); 
+        scanProbes(probed, probe_distances, scan_query, padded_query.data(), query_norm, distances, actual_vectors); 
+        actual_vectors.extract(_results + i * k, params.metric != Metric::L2); 
+    }
+
+}
+
+
+// List data one step of an interleaved scan covers, and so how far ahead it
+// prefetches.
+static const size_t INTERLEAVE_BLOCK_BYTES = 4096; 
 
-struct Compare {
-    bool operator()(const Pair& a, const Pair& b) {
-        return a.first > b.first;  // Smallest value first
+
+static void prefetchRange(const void* data, size_t bytes) {
+    const char* p = static_cast<const char*>(data); 
+    for (size_t offset = 0; offset < bytes; offset += 64) {
+        __builtin_prefetch(p + offset); 
     }
+}
+
+
+// Where one query of an interleaved group is in its scan.
+struct ScanCursor {
+    int slot;          // the query's row in the group buffers
+    int probe;         // index into its probed lists
+    size_t position;   // next member of the current list
+    int unchanged;     // lists in a row that left its top-k as it was
+    size_t insertions; // top-k insertions when the current list started
 };
 
-void IndexIVFFlat::query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
-    auto float_storage = std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset);
-    std::pair<IdxType, float>* _results = results; 
-    for(int i = 0; i < float_storage->get_num_points(); i++) {
-        std::priority_queue<Pair, std::vector<Pair>, Compare> pq;
-        for(int j = 0; j < centroids.size(); j++) {
-            pq.push(std::make_pair(
-                euclideanDistance(reinterpret_cast<const char *>(centroids[j].data()),
-                    float_storage->get_vector(i)),
-                j));
+
+// Interleaved search for memory-bound scans. Queries are taken params.interleave
+// at a time and their list scans advance in turns, one block per turn: after
+// scoring a block, a query prefetches its next one and hands over to the
+// next query, so the loads are in flight while the others compute. Each
+// query still sees exactly the lists and candidates of the plain scan.
+void IndexIVFFlat::queryInterleaved(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
+    size_t num_queries = dataset->get_num_points(); 
+    int group = params.interleave; 
+    bool tiled = params.layout == ListLayout::TILED; 
+    size_t row_bytes = tiled ? padded_dim * sizeof(float) : code_size; 
+    size_t block = std::max<size_t>(INTERLEAVE_BLOCK_BYTES / row_bytes, 1); 
+    if (tiled) {
+        block = (block + TILE_LANES - 1) / TILE_LANES * TILE_LANES; 
+    }
+
+    vector<float> scan_queries((size_t)group * dim); 
+    vector<float> padded_queries(tiled ? (size_t)group * padded_dim : 0, 0.0f); 
+    vector<float> query_norms(group); 
+    vector<vector<int>> probed(group); 
+    vector<vector<float>> probe_distances(group); 
+    vector<Pair> ranked(nlist); 
+    vector<TopK> top(group, TopK(k, spilled())); 
+    vector<ScanCursor> cursors; 
+    vector<float> distances; 
+
+    //issues the loads for the block a cursor will score on its next turn
+    auto prefetchBlock = [&](const ScanCursor& cursor) {
+        int list = probed[cursor.slot][cursor.probe]; 
+        size_t n = std::min(block, inverted_list[list].size() - cursor.position); 
+        if (tiled) {
+            prefetchRange(list_tiles[list].data() + cursor.position * padded_dim, n * row_bytes); 
+        } else {
+            prefetchRange(list_codes[list].data() + cursor.position * code_size, n * row_bytes); 
+        }
+        if (usesNorms()) {
+            prefetchRange(list_norms[list].data() + cursor.position, n * sizeof(float)); 
+        }
+        prefetchRange(inverted_list[list].data() + cursor.position, n * sizeof(int)); 
+    }; 
+    //moves a cursor to the next probed list worth scanning; false once it has none
+    //left or adaptive probing stops
+    auto nextList = [&](ScanCursor& cursor) {
+        const TopK& results = top[cursor.slot]; 
+        if (cursor.probe >= 0) {
+            cursor.unchanged = results.insertions() == cursor.insertions ? cursor.unchanged + 1 : 0; 
+        }
+        for (cursor.probe++; cursor.probe < (int)probed[cursor.slot].size(); cursor.probe++) {
+            int list = probed[cursor.slot][cursor.probe]; 
+            float distance = probe_distances[cursor.slot][cursor.probe]; 
+            if (stopProbing(cursor.probe, distance, cursor.unchanged, results)) {
+                return false; 
+            }
+            if (!inverted_list[list].empty() && !canSkipList(list, distance, query_norms[cursor.slot], results)) {
+                cursor.position = 0; 
+                cursor.insertions = results.insertions(); 
+                return true; 
+            }
+            cursor.unchanged++; 
+        }
+        return false; 
+    }; 
+
+    for (size_t first = 0; first < num_queries; first += group) {
+        int members = std::min<size_t>(group, num_queries - first); 
+        cursors.clear(); 
+        for (int slot = 0; slot < members; slot++) {
+            prepareQuery(dataset, first + slot, k, ranked, probed[slot], probe_distances[slot], scan_queries.data() + (size_t)slot * dim, 
+                tiled ? padded_queries.data() + (size_t)slot * padded_dim : nullptr, query_norms[slot]); 
+            ScanCursor cursor = {slot, -1, 0, 0, 0}; 
+            if (nextList(cursor)) {
+                prefetchBlock(cursor); 
+                cursors.push_back(cursor); 
+            }
+        }
+
+        while (!cursors.empty()) {
+            for (size_t c = 0; c < cursors.size();) {
+                ScanCursor& cursor = cursors[c]; 
+                int slot = cursor.slot; 
+                int list = probed[slot][cursor.probe]; 
+                size_t end = std::min(cursor.position + block, inverted_list[list].size()); 
+                //byte lists are scanned against the raw query bytes
+                const char* scan_query = element_type == ElementType::FLOAT
+                    ? reinterpret_cast<const char *>(scan_queries.data() + (size_t)slot * dim) : dataset->get_vector(first + slot); 
+                const float* padded_query = tiled ? padded_queries.data() + (size_t)slot * padded_dim : nullptr; 
+                if (!list_graphs[list].empty()) {
+                    //a graph list is searched in one turn
+                    searchListGraph(list, scan_query, query_norms[slot], top[slot]); 
+                    end = inverted_list[list].size(); 
+                } else {
+                    scanList(list, cursor.position, end, scan_query, padded_query, query_norms[slot], distances, top[slot]); 
+                }
+
+                cursor.position = end; 
+                if (cursor.position == inverted_list[list].size() && !nextList(cursor)) {
+                    cursors[c] = cursors.back(); 
+                    cursors.pop_back(); 
+                    continue; 
+                }
+                prefetchBlock(cursor); 
+                c++; 
+            }
+        }
+
+        for (int slot = 0; slot < members; slot++) {
+            top[slot].extract(results + (first + slot) * k, params.metric != Metric::L2); 
+        }
+    }
+}
+
+
+// Work handed from the assignment stage of the pipeline to a scan thread.
+struct MicroBatch {
+    size_t first;                  // index of its first query in the batch
+    int count; 
+    vector<float> scan_queries;    // count rows, see prepareQuery
+    vector<float> padded_queries; 
+    vector<float> query_norms; 
+    vector<vector<int>> probed;    // the lists of each query, see selectProbes
+    vector<vector<float>> probe_distances; 
+};
+
+
+// Pipelined batch search. The calling thread is the assignment stage: for
+// each micro-batch it ranks the centroids of all its queries with one GEMM
+// (||c||^2 - 2<q, c> for L2, -<q, c> otherwise) and queues the result. The
+// scan stage is params.pipeline_threads threads that take micro-batches off
+// the bounded queue, scan every query's lists and write its top-k. Results
+// go straight to disjoint rows of results, so there is no merge stage.
+void IndexIVFFlat::queryPipelined(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
+    using Clock = std::chrono::steady_clock; 
+    auto seconds = [](Clock::time_point from, Clock::time_point to) { return std::chrono::duration<double>(to - from).count(); }; 
+    size_t num_queries = dataset->get_num_points(); 
+    bool tiled = params.layout == ListLayout::TILED; 
+    int threads = params.pipeline_threads; 
+    size_t batch = std::max(params.micro_batch, 1); 
+
+    pipeline_stats = PipelineStats(); 
+    Clock::time_point start = Clock::now(); 
+    BoundedQueue<std::unique_ptr<MicroBatch>> queue(2 * threads); 
+    vector<double> scan_busy(threads, 0.0); 
+    vector<double> scan_idle(threads, 0.0); 
+
+    vector<std::thread> scanners; 
+    for (int t = 0; t < threads; t++) {
+        scanners.emplace_back([&, t] {
+            TopK top(k, spilled()); 
+            vector<float> distances; 
+            std::unique_ptr<MicroBatch> work; 
+            for (;;) {
+                Clock::time_point wait_start = Clock::now(); 
+                if (!queue.pop(work)) {
+                    break; 
+                }
+                Clock::time_point busy_start = Clock::now(); 
+                scan_idle[t] += seconds(wait_start, busy_start); 
+                for (int slot = 0; slot < work->count; slot++) {
+                    size_t i = work->first + slot; 
+                    //byte lists are scanned against the raw query bytes
+                    const char* scan_query = element_type == ElementType::FLOAT
+                        ? reinterpret_cast<const char *>(work->scan_queries.data() + (size_t)slot * dim) : dataset->get_vector(i); 
+                    const float* padded_query = tiled ? work->padded_queries.data() + (size_t)slot * padded_dim : nullptr; 
+                    scanProbes(work->probed[slot], work->probe_distances[slot], scan_query, padded_query, work->query_norms[slot], distances, top); 
+                    top.extract(results + i * k, params.metric != Metric::L2); 
+                }
+                scan_busy[t] += seconds(busy_start, Clock::now()); 
+            }
+        }); 
+    }
+
+    //with the coarse graph every query ranks its lists by graph search instead
+    bool linear = coarse_graph.empty(); 
+    vector<float> queries(batch * dim); 
+    vector<float> coarse(linear ? batch * nlist : 0); 
+    vector<Pair> ranked(nlist); 
+    vector<float> buffer(dim); 
+    for (size_t first = 0; first < num_queries; first += batch) {
+        Clock::time_point busy_start = Clock::now(); 
+        int count = std::min(batch, num_queries - first); 
+        for (int slot = 0; slot < count; slot++) {
+            const float* q = queryAsFloat(dataset, first + slot, buffer.data()); 
+            std::copy(q, q + dim, queries.begin() + (size_t)slot * dim); 
+        }
+        //coarse[slot][j] = <q_slot, c_j> for the whole micro-batch
+        if (linear) {
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, count, nlist, dim, 1.0f, queries.data(), dim, 
+                        centroid_matrix.data(), dim, 0.0f, coarse.data(), nlist); 
+        }
+
+        auto work = std::make_unique<MicroBatch>(); 
+        work->first = first; 
+        work->count = count; 
+        work->scan_queries.resize((size_t)count * dim); 
+        work->padded_queries.resize(tiled ? (size_t)count * padded_dim : 0, 0.0f); 
+        work->query_norms.resize(count); 
+        work->probed.resize(count); 
+        work->probe_distances.resize(count); 
+        for (int slot = 0; slot < count; slot++) {
+            prepareScanQuery(queries.data() + (size_t)slot * dim, work->scan_queries.data() + (size_t)slot * dim, 
+                tiled ? work->padded_queries.data() + (size_t)slot * padded_dim : nullptr, work->query_norms[slot]); 
+            if (!linear) {
+                rankCentroids(queries.data() + (size_t)slot * dim, listsToRank(), ranked); 
+            } else {
+                //the L2 ranking leaves out ||q||^2; it is added back so the probe
+                //distances are the squared distances the list pruning expects
+                const float* row = coarse.data() + (size_t)slot * nlist; 
+                float query_norm = params.metric == Metric::L2 ? work->query_norms[slot] : 0.0f; 
+                ranked.resize(nlist); 
+                for (int j = 0; j < nlist; j++) {
+                    ranked[j] = std::make_pair(params.metric == Metric::L2 ? query_norm + centroid_norms[j] - 2 * row[j] : -row[j], j); 
+                }
+            }
+            selectProbes(ranked, k, work->query_norms[slot], work->probed[slot], work->probe_distances[slot]); 
+        }
+
+        Clock::time_point push_start = Clock::now(); 
+        pipeline_stats.assign += seconds(busy_start, push_start); 
+        queue.push(std::move(work)); 
+        pipeline_stats.assign_blocked += seconds(push_start, Clock::now()); 
+        pipeline_stats.micro_batches++; 
+    }
+    queue.close(); 
+    for (std::thread& scanner : scanners) {
+        scanner.join(); 
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pipeline_stats.scan += scan_busy[t]; 
+        pipeline_stats.scan_idle += scan_idle[t]; 
+    }
+    pipeline_stats.total = seconds(start, Clock::now()); 
+}
+
+
+// Visits a query's probed lists in order, applying list pruning and the
+// adaptive stop, and collects its candidates in top.
+void IndexIVFFlat::scanProbes(const vector<int>& probed, const vector<float>& probe_distances, const char* query, const float* padded_query, float query_norm, 
+                              vector<float>& distances, TopK& top) {
+    int unchanged = 0; 
+    for (size_t j = 0; j < probed.size(); j++) {
+        int list = probed[j]; 
+        if (stopProbing(j, probe_distances[j], unchanged, top)) {
+            break; 
+        }
+        size_t insertions = top.insertions(); 
+        if (!canSkipList(list, probe_distances[j], query_norm, top)) {
+            if (!list_graphs[list].empty()) {
+                searchListGraph(list, query, query_norm, top); 
+            } else if (params.sort_lists) {
+                scanSortedList(list, probe_distances[j], query, padded_query, query_norm, distances, top); 
+            } else {
+                scanList(list, 0, inverted_list[list].size(), query, padded_query, query_norm, distances, top); 
+            }
+        }
+        unchanged = top.insertions() == insertions ? unchanged + 1 : 0; 
+    }
+}
+
+
+// Fills what a search needs to scan for query i: the lists to probe with
+// their centroid distances (see selectProbes); the query as the scan sees it
+// (normalised for cosine, permuted for early abandoning); its zero-padded copy
+// when the layout is tiled (padded_query may be null otherwise); and ||q||^2.
+void IndexIVFFlat::prepareQuery(const std::shared_ptr<IStorage>& dataset, int i, int k, vector<pair<float, int>>& ranked, vector<int>& probed, 
+                                vector<float>& probe_distances, float* scan_query, float* padded_query, float& query_norm) {
+    vector<float> buffer(dim); 
+    const float* q = queryAsFloat(dataset, i, buffer.data()); 
+    prepareScanQuery(q, scan_query, padded_query, query_norm); 
+    rankCentroids(q, listsToRank(), ranked); 
+    selectProbes(ranked, k, query_norm, probed, probe_distances); 
+}
+
+
+// Query i as fp32, normalised for cosine; buffer holds dim floats.
+const float* IndexIVFFlat::queryAsFloat(const std::shared_ptr<IStorage>& dataset, int i, float* buffer) {
+    const float* q = vectorAsFloat(dataset, element_type, i, dim, buffer); 
+    if (params.metric == Metric::COSINE) {
+        normalizeVector(q, buffer, dim); 
+        q = buffer; 
+    }
+    return q; 
+}
+
+
+// Sets probed to the probeLimit() lists with the smallest coarse distance in
+// ranked, nearest first, and probe_distances to their distances. With a
+// trained router the lists are instead the best scored of the router's
+// candidates, in score order. When those lists hold fewer than k vectors
+// between them, the next nearest are added until they do. ranked holds
+// (distance, list) pairs from rankCentroids: every list, or with the coarse
+// graph only the ones its search found, which also bounds the expansion.
+void IndexIVFFlat::selectProbes(vector<pair<float, int>>& ranked, int k, float query_norm, vector<int>& probed, vector<float>& probe_distances) {
+    int available = ranked.size(); 
+    int probes = std::min(probeLimit(), available); 
+    if (router.trained()) {
+        int candidates = std::max(std::min(router.candidates(), available), probes); 
+        std::partial_sort(ranked.begin(), ranked.begin() + candidates, ranked.end()); 
+        routeProbes(ranked, candidates, query_norm); 
+    } else {
+        std::partial_sort(ranked.begin(), ranked.begin() + probes, ranked.end()); 
+    }
+    size_t members = 0; 
+    for (int j = 0; j < probes; j++) {
+        members += inverted_list[ranked[j].second].size(); 
+    }
+    if (members < (size_t)k) {
+        std::sort(ranked.begin() + probes, ranked.end()); 
+        for (; probes < available && members < (size_t)k; probes++) {
+            members += inverted_list[ranked[probes].second].size(); 
+        }
+    }
+    probed.resize(probes); 
+    probe_distances.resize(probes); 
+    for (int j = 0; j < probes; j++) {
+        probed[j] = ranked[j].second; 
+        probe_distances[j] = ranked[j].first; 
+    }
+}
+
+
+// Reorders the nearest candidates lists at the front of ranked (sorted by
+// distance) by decreasing router score.
+void IndexIVFFlat::routeProbes(vector<pair<float, int>>& ranked, int candidates, float query_norm) {
+    vector<float> features((size_t)candidates * ProbeRouter::NUM_FEATURES); 
+    routerFeatures(ranked, candidates, query_norm, features.data()); 
+    vector<pair<float, int>> scored(candidates); 
+    for (int j = 0; j < candidates; j++) {
+        scored[j] = std::make_pair(-router.score(features.data() + (size_t)j * ProbeRouter::NUM_FEATURES), j); 
+    }
+    std::stable_sort(scored.begin(), scored.end()); 
+    vector<pair<float, int>> nearest(ranked.begin(), ranked.begin() + candidates); 
+    for (int j = 0; j < candidates; j++) {
+        ranked[j] = nearest[scored[j].second]; 
+    }
+}
+
+
+// Router features of the candidates nearest lists at the front of ranked,
+// sorted by distance; see ProbeRouter::NUM_FEATURES.
+void IndexIVFFlat::routerFeatures(const vector<pair<float, int>>& ranked, int candidates, float query_norm, float* features) {
+    float nearest = ranked[0].first; 
+    float unit = std::fabs(nearest) + 1e-6f; 
+    float window = ranked[candidates - 1].first - nearest + 1e-6f; 
+    float runner_up = candidates > 1 ? ranked[1].first : nearest; 
+    for (int j = 0; j < candidates; j++) {
+        auto [distance, list] = ranked[j]; 
+        float* row = features + (size_t)j * ProbeRouter::NUM_FEATURES; 
+        row[0] = (float)j / candidates; 
+        row[1] = (distance - nearest) / unit; 
+        row[2] = (distance - nearest) / window; 
+        row[3] = std::log1p((float)inverted_list[list].size()); 
+        row[4] = (distance - listLowerBound(list, distance, query_norm)) / unit; 
+        row[5] = (runner_up - nearest) / unit; 
+    }
+}
+
+
+// Trains the probe router offline from a query set and its ground truth:
+// gt holds gt_k neighbour ids per query (ids of the vectors add() indexed).
+// Each query contributes its candidate lists, labelled by whether they hold
+// one of its neighbours. Later queries probe in the order the router predicts.
+void IndexIVFFlat::trainRouter(std::shared_ptr<IStorage> queries, const std::pair<IdxType, float>* gt, int gt_k, const RouterParameters& p) {
+    checkElementType(queries); 
+    int candidates = std::min(p.candidates > 0 ? p.candidates : 4 * probeLimit(), nlist); 
+    size_t num_ids = 0; 
+    for (const vector<int>& ids : inverted_list) {
+        for (int id : ids) {
+            num_ids = std::max(num_ids, (size_t)id + 1); 
+        }
+    }
+    //the lists of id are lists_of[list_start[id], list_start[id + 1]); more than one when spilled
+    vector<size_t> list_start(num_ids + 1, 0); 
+    for (const vector<int>& ids : inverted_list) {
+        for (int id : ids) {
+            list_start[id + 1]++; 
+        }
+    }
+    std::partial_sum(list_start.begin(), list_start.end(), list_start.begin()); 
+    vector<int> lists_of(list_start.back()); 
+    vector<size_t> fill(list_start.begin(), list_start.end() - 1); 
+    for (int list = 0; list < nlist; list++) {
+        for (int id : inverted_list[list]) {
+            lists_of[fill[id]++] = list; 
+        }
+    }
+
+    vector<float> features; 
+    vector<float> labels; 
+    vector<float> buffer(dim); 
+    vector<Pair> ranked; 
+    vector<bool> holds_neighbour(nlist, false); 
+    for (int i = 0; i < queries->get_num_points(); i++) {
+        const float* q = queryAsFloat(queries, i, buffer.data()); 
+        float query_norm = centroid_ip_kernel(reinterpret_cast<const char *>(q), reinterpret_cast<const char *>(q), dim); 
+        rankCentroids(q, candidates, ranked); 
+        //the coarse graph may find fewer lists for some queries; selectProbes() clamps the same way
+        int count = std::min<int>(candidates, ranked.size()); 
+        std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end()); 
+        size_t row = features.size(); 
+        features.resize(row + (size_t)count * ProbeRouter::NUM_FEATURES); 
+        routerFeatures(ranked, count, query_norm, features.data() + row); 
+        for (int t = 0; t < gt_k; t++) {
+            IdxType id = gt[(size_t)i * gt_k + t].first; 
+            if ((size_t)id < num_ids) {
+                for (size_t j = list_start[id]; j < list_start[id + 1]; j++) {
+                    holds_neighbour[lists_of[j]] = true; 
+                }
+            }
+        }
+        for (int j = 0; j < count; j++) {
+            labels.push_back(holds_neighbour[ranked[j].second] ? 1.0f : 0.0f); 
+        }
+        std::fill(holds_neighbour.begin(), holds_neighbour.end(), false); 
+    }
+    router.train(features, labels, candidates, p); 
+}
+
+
+// Coarse distances of q: (distance, list) for every list, or with the coarse
+// graph for the lists a beam search of width max(coarse_graph_beam, wanted)
+// finds, nearest first. Either way the cost of the graph path grows with the
+// beam and the graph degree, not with nlist.
+void IndexIVFFlat::rankCentroids(const float* q, int wanted, vector<pair<float, int>>& ranked) {
+    if (coarse_graph.empty()) {
+        ranked.resize(nlist); 
+        for (int j = 0; j < nlist; j++) {
+            ranked[j] = std::make_pair(centroidDistance(q, j), j); 
+        }
+        return; 
+    }
+    coarse_graph.search([&](int list) { return centroidDistance(q, list); }, std::max(params.coarse_graph_beam, wanted), ranked); 
+}
+
+
+// Lists vector v (as the centroids see it) is stored in: its nearest list,
+// and with spill > 1 the next spill - 1 nearest. With soar_lambda > 0 the
+// extra lists are instead picked one by one to minimise the SOAR loss
+// ||v - c||^2 + soar_lambda * sum <r, v - c>^2 / ||r||^2 over the residuals
+// r = v - c' of the lists already chosen, which prefers lists whose residual
+// is orthogonal to theirs and so rarely loses the vector with them.
+void IndexIVFFlat::assignLists(const float* v, vector<pair<float, int>>& ranked, vector<int>& lists) {
+    int spill = std::min(std::max(params.spill, 1), nlist); 
+    rankCentroids(v, spill, ranked); 
+    if (list_cap > 0) {
+        //full lists drop out, so the vector overflows to the next-nearest ones
+        auto full = [&](const Pair& entry) { return inverted_list[entry.second].size() >= list_cap; }; 
+        if (!std::all_of(ranked.begin(), ranked.end(), full)) {
+            ranked.erase(std::remove_if(ranked.begin(), ranked.end(), full), ranked.end()); 
+        }
+    }
+    spill = std::min<int>(spill, ranked.size()); 
+    lists.clear(); 
+    if (spill == 1) {
+        lists.push_back(std::min_element(ranked.begin(), ranked.end())->second); 
+        return; 
+    }
+    if (params.soar_lambda <= 0) {
+        std::partial_sort(ranked.begin(), ranked.begin() + spill, ranked.end()); 
+        for (int j = 0; j < spill; j++) {
+            lists.push_back(ranked[j].second); 
+        }
+        return; 
+    }
+
+    const char* x = reinterpret_cast<const char *>(v); 
+    lists.push_back(std::min_element(ranked.begin(), ranked.end())->second); 
+    vector<float> residuals; 
+    vector<float> residual_norms; 
+    vector<float> residual_dots;   // <r, v> per chosen residual
+    while ((int)lists.size() < spill) {
+        const float* c = centroids[lists.back()].data(); 
+        size_t offset = residuals.size(); 
+        for (int d = 0; d < dim; d++) {
+            residuals.push_back(v[d] - c[d]); 
+        }
+        const char* r = reinterpret_cast<const char *>(residuals.data() + offset); 
+        residual_norms.push_back(centroid_ip_kernel(r, r, dim)); 
+        residual_dots.push_back(centroid_ip_kernel(r, x, dim)); 
+
+        float best_loss = std::numeric_limits<float>::max(); 
+        int best_list = -1; 
+        for (const auto& [distance, list] : ranked) {
+            if (std::find(lists.begin(), lists.end(), list) != lists.end()) {
+                continue; 
+            }
+            const char* centroid = reinterpret_cast<const char *>(centroids[list].data()); 
+            float loss = params.metric == Metric::L2 ? distance : l2_kernel(x, centroid, dim); 
+            for (size_t j = 0; j < residual_norms.size(); j++) {
+                if (residual_norms[j] <= 0) {
+                    continue; 
+                }
+                const char* chosen = reinterpret_cast<const char *>(residuals.data() + j * dim); 
+                float parallel = residual_dots[j] - centroid_ip_kernel(chosen, centroid, dim); 
+                loss += params.soar_lambda * parallel * parallel / residual_norms[j]; 
+            }
+            if (loss < best_loss) {
+                best_loss = loss; 
+                best_list = list; 
+            }
+        }
+        lists.push_back(best_list); 
+    }
+}
+
+
+// Bytes the inverted lists hold: stored vectors, norms, ids and per-member
+// distances. Spilled vectors count once per list they are in.
+size_t IndexIVFFlat::listBytes() const {
+    size_t bytes = 0; 
+    for (int list = 0; list < nlist; list++) {
+        bytes += params.layout == ListLayout::TILED ? list_tiles[list].size() * sizeof(float) : list_codes[list].size(); 
+        bytes += list_norms[list].size() * sizeof(float) + inverted_list[list].size() * sizeof(int); 
+        bytes += params.sort_lists ? member_distances[list].size() * sizeof(float) : 0; 
+    }
+    return bytes; 
+}
+
+
+size_t IndexIVFFlat::largestList() const {
+    size_t largest = 0; 
+    for (const vector<int>& ids : inverted_list) {
+        largest = std::max(largest, ids.size()); 
+    }
+    return largest; 
+}
+
+
+size_t IndexIVFFlat::numEntries() const {
+    size_t entries = 0; 
+    for (const vector<int>& ids : inverted_list) {
+        entries += ids.size(); 
+    }
+    return entries; 
+}
+
+
+// Lists a query needs ranked: the probe limit, or the router's candidates.
+int IndexIVFFlat::listsToRank() const {
+    return std::max(probeLimit(), router.trained() ? std::min(router.candidates(), nlist) : 0); 
+}
+
+
+// Indexes the centroids with a proximity graph, entered at the centroid
+// nearest the mean. Edges use L2 between centroids; for IP and cosine the
+// centroids are unit length, where that order matches -<q, c>.
+void IndexIVFFlat::buildCoarseGraph() {
+    vector<double> mean(dim, 0.0); 
+    for (const vector<float>& c : centroids) {
+        for (int d = 0; d < dim; d++) {
+            mean[d] += c[d] / nlist; 
+        }
+    }
+    vector<float> center(mean.begin(), mean.end()); 
+    int entry = 0; 
+    float entry_distance = l2_kernel(reinterpret_cast<const char *>(center.data()), reinterpret_cast<const char *>(centroids[0].data()), dim); 
+    for (int j = 1; j < nlist; j++) {
+        float distance = l2_kernel(reinterpret_cast<const char *>(center.data()), reinterpret_cast<const char *>(centroids[j].data()), dim); 
+        if (distance < entry_distance) {
+            entry_distance = distance; 
+            entry = j; 
+        }
+    }
+    coarse_graph = ProximityGraph(params.coarse_graph_degree, std::max(2 * params.coarse_graph_degree, params.coarse_graph_beam)); 
+    coarse_graph.build(nlist, entry, [&](int a, int b) {
+        return l2_kernel(reinterpret_cast<const char *>(centroids[a].data()), reinterpret_cast<const char *>(centroids[b].data()), dim); 
+    }); 
+}
+
+
+// Most lists a query visits before the fewer-than-k expansion.
+int IndexIVFFlat::probeLimit() const {
+    return std::min(params.max_nprobe > 0 ? params.max_nprobe : nprobe, nlist); 
+}
+
+
+// Adaptive probing: true when a query that has visited probes lists, and has
+// not changed its top-k over the last unchanged of them, should not go on to
+// the list at centroid_distance. Never before min_nprobe lists or while the
+// top-k still has room.
+bool IndexIVFFlat::stopProbing(int probes, float centroid_distance, int unchanged, const TopK& top) const {
+    if (probes < params.min_nprobe || !top.full()) {
+        return false; 
+    }
+    if (params.probe_ratio > 0 && params.metric == Metric::L2 && centroid_distance > params.probe_ratio * top.best()) {
+        return true; 
+    }
+    return params.probe_patience > 0 && unchanged >= params.probe_patience; 
+}
+
+
+void IndexIVFFlat::prepareScanQuery(const float* q, float* scan_query, float* padded_query, float& query_norm) {
+    if (dim_order.empty()) {
+        std::copy(q, q + dim, scan_query); 
+    } else {
+        permuteDims(q, scan_query); 
+    }
+    if (params.layout == ListLayout::TILED) {
+        std::copy(q, q + dim, padded_query); 
+    }
+    query_norm = centroid_ip_kernel(reinterpret_cast<const char *>(q), reinterpret_cast<const char *>(q), dim); 
+}
+
+
+// List data one block of the batch scan covers, small enough to stay in L2
+// while every query that probes the list passes over it.
+static const size_t LIST_BLOCK_BYTES = 256 * 1024; 
+
+
+// List-major batch search. Coarse assignment runs for the whole batch first;
+// the (query, list) pairs are then grouped by list so each probed list is
+// streamed from memory once, in blocks, against all of its queries. FP32
+// inner-product scans use the multi-query ip_block kernel, everything else
+// goes through scanList per query. Every query keeps its own top-k.
+void IndexIVFFlat::queryByList(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
+    size_t num_queries = dataset->get_num_points(); 
+    bool tiled = params.layout == ListLayout::TILED; 
+
+    //queries as the scan sees them, see prepareQuery
+    vector<float> scan_queries(num_queries * dim); 
+    vector<float> padded_queries(tiled ? num_queries * padded_dim : 0, 0.0f); 
+    vector<float> query_norms(num_queries, 0.0f); 
+    vector<vector<int>> probing_queries(nlist); 
+    vector<vector<float>> probing_distances(nlist);   // centroid distance of each of them
+    vector<Pair> ranked(nlist); 
+    vector<int> probed; 
+    vector<float> probe_distances; 
+    for (size_t i = 0; i < num_queries; i++) {
+        prepareQuery(dataset, i, k, ranked, probed, probe_distances, scan_queries.data() + i * dim, 
+            tiled ? padded_queries.data() + i * padded_dim : nullptr, query_norms[i]); 
+        for (size_t j = 0; j < probed.size(); j++) {
+            probing_queries[probed[j]].push_back(i); 
+            probing_distances[probed[j]].push_back(probe_distances[j]); 
+        }
+    }
+
+    bool blocked_ip = params.layout == ListLayout::ROWS && params.precision == ListPrecision::FP32 && !params.early_abandon
+        && element_type == ElementType::FLOAT && (usesNorms() || params.metric != Metric::L2); 
+    size_t row_bytes = tiled ? padded_dim * sizeof(float) : code_size; 
+    size_t block = std::max<size_t>(LIST_BLOCK_BYTES / row_bytes / TILE_LANES, 1) * TILE_LANES; 
+
+    vector<TopK> top; 
+    top.reserve(num_queries); 
+    for (size_t i = 0; i < num_queries; i++) {
+        top.emplace_back(k, spilled()); 
+    }
+    vector<int> queries; 
+    vector<float> gathered; 
+    vector<float> block_distances; 
+    vector<float> distances; 
+    for (int list = 0; list < nlist; list++) {
+        size_t size = inverted_list[list].size(); 
+        //lists go in index order here, so the pruning only sees the top-k
+        //the earlier lists of each query happened to fill
+        queries.clear(); 
+        for (size_t j = 0; j < probing_queries[list].size(); j++) {
+            int i = probing_queries[list][j]; 
+            if (!canSkipList(list, probing_distances[list][j], query_norms[i], top[i])) {
+                queries.push_back(i); 
+            }
+        }
+        if (queries.empty() || size == 0) {
+            continue; 
+        }
+        if (!list_graphs[list].empty()) {
+            for (int i : queries) {
+                const char* scan_query = element_type == ElementType::FLOAT
+                    ? reinterpret_cast<const char *>(scan_queries.data() + (size_t)i * dim) : dataset->get_vector(i); 
+                searchListGraph(list, scan_query, query_norms[i], top[i]); 
+            }
+            continue; 
+        }
+        if (blocked_ip) {
+            gathered.resize(queries.size() * dim); 
+            for (size_t j = 0; j < queries.size(); j++) {
+                std::copy_n(scan_queries.begin() + (size_t)queries[j] * dim, dim, gathered.begin() + j * dim); 
+            }
+        }
+        for (size_t begin = 0; begin < size; begin += block) {
+            size_t end = std::min(size, begin + block); 
+            if (blocked_ip) {
+                size_t n = end - begin; 
+                const float* x = reinterpret_cast<const float*>(list_codes[list].data()) + begin * dim; 
+                block_distances.resize(queries.size() * n); 
+                ip_block_kernel(gathered.data(), queries.size(), x, n, dim, block_distances.data()); 
+                for (size_t j = 0; j < queries.size(); j++) {
+                    float* row = block_distances.data() + j * n; 
+                    finishDistances(list, begin, n, query_norms[queries[j]], row); 
+                    top[queries[j]].push(row, inverted_list[list].data() + begin, n); 
+                }
+                continue; 
+            }
+            for (int i : queries) {
+                //byte lists are scanned against the raw query bytes
+                const char* scan_query = element_type == ElementType::FLOAT
+                    ? reinterpret_cast<const char *>(scan_queries.data() + (size_t)i * dim) : dataset->get_vector(i); 
+                const float* padded_query = tiled ? padded_queries.data() + (size_t)i * padded_dim : nullptr; 
+                scanList(list, begin, end, scan_query, padded_query, query_norms[i], distances, top[i]); 
+            }
+        }
+    }
+
+    for (size_t i = 0; i < num_queries; i++) {
+        top[i].extract(results + i * k, params.metric != Metric::L2); 
+    }
+}
+
+
+// Scores members [begin, end) of a list and hands the distances to the top-k
+// in one block; begin is a multiple of TILE_LANES. query is in the dataset
+// element type; padded_query is its fp32, zero-padded copy used by the tiled
+// layout.
+void IndexIVFFlat::scanList(int list, size_t begin, size_t end, const char* query, const float* padded_query, float query_norm, vector<float>& distances, TopK& results) {
+    const int* ids = inverted_list[list].data() + begin; 
+    size_t n = end - begin; 
+    if (params.layout == ListLayout::TILED) {
+        size_t num_tiles = (n + TILE_LANES - 1) / TILE_LANES; 
+        distances.resize(num_tiles * TILE_LANES); 
+        const float* tile = list_tiles[list].data() + begin * padded_dim; 
+        for (size_t t = 0; t < num_tiles; t++, tile += padded_dim * TILE_LANES) {
+            tile_kernel(padded_query, tile, padded_dim, distances.data() + t * TILE_LANES); 
+        }
+    } else if (params.early_abandon) {
+        //one candidate at a time, so every push can tighten the threshold for the next
+        const float* q = reinterpret_cast<const float*>(query); 
+        const float* x = reinterpret_cast<const float*>(list_codes[list].data()) + begin * dim; 
+        for (size_t p = 0; p < n; p++, x += dim) {
+            float threshold = results.threshold(); 
+            float distance = early_abandon_kernel(q, x, dim, threshold); 
+            if (distance < threshold) {
+                results.push(distance, ids[p]); 
+            }
+        }
+        return; 
+    } else {
+        distances.resize(n); 
+        DistanceKernel kernel = params.metric == Metric::L2 && !usesNorms() ? list_kernel : ip_kernel; 
+        const char* code = list_codes[list].data() + begin * code_size; 
+        for (size_t p = 0; p < n; p++, code += code_size) {
+            distances[p] = kernel(query, code, dim); 
+        }
+    }
+    finishDistances(list, begin, n, query_norm, distances.data()); 
+    //lanes past the end of the last tile are padding and never reach the top-k
+    results.push(distances.data(), ids, n); 
+}
+
+
+// Members one step of a sorted-list scan covers; a multiple of TILE_LANES so
+// every step starts on a tile.
+static const size_t SORTED_SCAN_BLOCK = 64; 
+
+
+// Bounded scan of a list kept in order of member distance to the centroid.
+// A member at distance r from the centroid is at least (||q - c|| - r)^2 from
+// the query under L2, and at least -<q, c> - ||q|| r under IP and cosine. The
+// scan starts at the block where that bound is smallest, near r = ||q - c||
+// (the end of the list for IP), and walks outward in both directions, block
+// by block, until the nearest member of the next block cannot beat the k-th best.
+void IndexIVFFlat::scanSortedList(int list, float centroid_distance, const char* query, const float* padded_query, float query_norm, vector<float>& distances, TopK& results) {
+    const vector<float>& radii = member_distances[list]; 
+    size_t size = radii.size(); 
+    if (size == 0) {
+        return; 
+    }
+    float query_distance = std::sqrt(std::max(centroid_distance, 0.0f)); 
+    float query_length = std::sqrt(query_norm); 
+    auto bound = [&](float radius) {
+        if (params.metric == Metric::L2) {
+            return (query_distance - radius) * (query_distance - radius); 
+        }
+        return centroid_distance - query_length * radius; 
+    }; 
+    size_t start = size - 1; 
+    if (params.metric == Metric::L2) {
+        start = std::min<size_t>(std::lower_bound(radii.begin(), radii.end(), query_distance) - radii.begin(), size - 1); 
+    }
+
+    size_t up = start / SORTED_SCAN_BLOCK * SORTED_SCAN_BLOCK;   // next block above
+    size_t down = up;                                            // blocks below start here
+    scanList(list, up, std::min(size, up + SORTED_SCAN_BLOCK), query, padded_query, query_norm, distances, results); 
+    up += SORTED_SCAN_BLOCK; 
+    bool up_open = up < size; 
+    bool down_open = down > 0; 
+    while (up_open || down_open) {
+        if (up_open) {
+            if (bound(radii[up]) > results.threshold()) {
+                up_open = false; 
+            } else {
+                scanList(list, up, std::min(size, up + SORTED_SCAN_BLOCK), query, padded_query, query_norm, distances, results); 
+                up += SORTED_SCAN_BLOCK; 
+                up_open = up < size; 
+            }
+        }
+        if (down_open) {
+            if (bound(radii[down - 1]) > results.threshold()) {
+                down_open = false; 
+            } else {
+                down -= SORTED_SCAN_BLOCK; 
+                scanList(list, down, down + SORTED_SCAN_BLOCK, query, padded_query, query_norm, distances, results); 
+                down_open = down > 0; 
+            }
+        }
+    }
+}
+
+
+// Builds the proximity graph of an oversized list over its members as
+// stored (decoded to fp32 where needed), entered at the member nearest the
+// centroid. Node p is member p, so it is rebuilt whenever the list changes.
+void IndexIVFFlat::buildListGraph(int list) {
+    size_t size = inverted_list[list].size(); 
+    vector<float> decoded; 
+    const float* x = reinterpret_cast<const float*>(list_codes[list].data()); 
+    if (element_type != ElementType::FLOAT || params.precision != ListPrecision::FP32) {
+        decoded.resize(size * dim); 
+        for (size_t p = 0; p < size; p++) {
+            decodeMember(list, p, decoded.data() + p * dim); 
+        }
+        x = decoded.data(); 
+    }
+    vector<float> center(dim); 
+    const float* c = permuteDims(centroids[list].data(), center.data()); 
+    int entry = 0; 
+    float entry_distance = std::numeric_limits<float>::max(); 
+    for (size_t p = 0; p < size; p++) {
+        float distance = l2_kernel(reinterpret_cast<const char *>(x + p * dim), reinterpret_cast<const char *>(c), dim); 
+        if (distance < entry_distance) {
+            entry_distance = distance; 
+            entry = p; 
         }
+    }
+    list_graphs[list] = ProximityGraph(params.list_graph_degree, std::max(2 * params.list_graph_degree, params.list_graph_beam)); 
+    list_graphs[list].build(size, entry, [&](int a, int b) {
+        return l2_kernel(reinterpret_cast<const char *>(x + (size_t)a * dim), reinterpret_cast<const char *>(x + (size_t)b * dim), dim); 
+    }); 
+}
+
+
+// Member p of a row list as fp32, in stored dimension order.
+void IndexIVFFlat::decodeMember(int list, size_t p, float* out) {
+    const char* code = list_codes[list].data() + p * code_size; 
+    for (int j = 0; j < dim; j++) {
+        if (element_type == ElementType::INT8) {
+            out[j] = reinterpret_cast<const int8_t*>(code)[j]; 
+        } else if (element_type == ElementType::UINT8) {
+            out[j] = reinterpret_cast<const uint8_t*>(code)[j]; 
+        } else if (params.precision == ListPrecision::FP16) {
+            out[j] = fp16ToFloat(reinterpret_cast<const uint16_t*>(code)[j]); 
+        } else if (params.precision == ListPrecision::BF16) {
+            out[j] = bf16ToFloat(reinterpret_cast<const uint16_t*>(code)[j]); 
+        } else {
+            out[j] = reinterpret_cast<const float*>(code)[j]; 
+        }
+    }
+}
+
+
+// Searches a list's graph with a beam of max(list_graph_beam, k) instead of
+// scanning it, and hands the members the beam ends with to the top-k. Their
+// distances are the ones the linear scan computes.
+void IndexIVFFlat::searchListGraph(int list, const char* query, float query_norm, TopK& results) {
+    thread_local vector<pair<float, int>> found; 
+    list_graphs[list].search([&](int p) { return memberDistance(list, p, query, query_norm); }, 
+                             std::max(params.list_graph_beam, results.capacity()), found); 
+    const int* ids = inverted_list[list].data(); 
+    for (const auto& [distance, p] : found) {
+        results.push(distance, ids[p]); 
+    }
+}
+
+
+// Distance from the query to member p of a row list, as scanList computes it.
+float IndexIVFFlat::memberDistance(int list, size_t p, const char* query, float query_norm) {
+    const char* code = list_codes[list].data() + p * code_size; 
+    if (params.metric == Metric::L2 && !usesNorms()) {
+        return list_kernel(query, code, dim); 
+    }
+    float ip = ip_kernel(query, code, dim); 
+    if (usesNorms()) {
+        return std::max(query_norm + list_norms[list][p] - 2 * ip, 0.0f); 
+    }
+    return -ip; 
+}
+
 
-        std::priority_queue<Pair, std::vector<Pair>, Compare> actual_vectors;
+// Reorders a list by increasing member distance to the centroid, moving the
+// ids, stored vectors and norms along.
+void IndexIVFFlat::sortList(int list) {
+    size_t size = inverted_list[list].size(); 
+    vector<size_t> order(size); 
+    std::iota(order.begin(), order.end(), 0); 
+    const vector<float>& radii = member_distances[list]; 
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return radii[a] < radii[b]; }); 
 
-        for(int j = 0; j < nprobe; j++) {
-            auto [distance, index] = pq.top(); 
-            pq.pop(); 
-            vector<int> centroid_vectors = inverted_list[index]; 
-            for (int indexes : centroid_vectors) {
-                actual_vectors.push(
-                    std::pair<float, int>(
-                    euclideanDistance(reinterpret_cast<const char *>(base_storage[indexes].data()),
-                        float_storage->get_vector(i)),
-                        indexes)
-                    );
+    auto reorder = [&](auto& values) {
+        std::remove_reference_t<decltype(values)> sorted(values.size()); 
+        for (size_t p = 0; p < size; p++) {
+            sorted[p] = values[order[p]]; 
+        }
+        values.swap(sorted); 
+    }; 
+    reorder(inverted_list[list]); 
+    reorder(member_distances[list]); 
+    if (!list_norms[list].empty()) {
+        reorder(list_norms[list]); 
+    }
+    if (params.layout == ListLayout::TILED) {
+        const AlignedVector<float>& tiles = list_tiles[list]; 
+        AlignedVector<float> sorted(tiles.size(), 0.0f); 
+        size_t tile_floats = (size_t)padded_dim * TILE_LANES; 
+        for (size_t p = 0; p < size; p++) {
+            const float* from = tiles.data() + order[p] / TILE_LANES * tile_floats + order[p] % TILE_LANES; 
+            float* to = sorted.data() + p / TILE_LANES * tile_floats + p % TILE_LANES; 
+            for (int d = 0; d < dim; d++) {
+                to[d * TILE_LANES] = from[d * TILE_LANES]; 
             }
         }
+        list_tiles[list].swap(sorted); 
+    } else {
+        const vector<char>& codes = list_codes[list]; 
+        vector<char> sorted(codes.size()); 
+        for (size_t p = 0; p < size; p++) {
+            std::memcpy(sorted.data() + p * code_size, codes.data() + order[p] * code_size, code_size); 
+        }
+        list_codes[list].swap(sorted); 
+    }
+}
+
+
+// Turns kernel output into distances where needed. With stored norms the
+// kernels return <q, x> and the distance is rebuilt as
+// ||q||^2 + ||x||^2 - 2<q, x>; for IP and cosine it is -<q, x>.
+void IndexIVFFlat::finishDistances(int list, size_t begin, size_t n, float query_norm, float* distances) {
+    if (usesNorms()) {
+        const float* norms = list_norms[list].data() + begin; 
+        for (size_t p = 0; p < n; p++) {
+            //cancellation can leave tiny negatives for near duplicates
+            distances[p] = std::max(query_norm + norms[p] - 2 * distances[p], 0.0f); 
+        }
+    } else if (params.metric != Metric::L2) {
+        for (size_t p = 0; p < n; p++) {
+            distances[p] = -distances[p]; 
+        }
+    }
+}
 
 
+// Lower bound on the distance from a query to any member of a list, from the
+// query's centroid distance and the list radius r. For L2 the triangle
+// inequality gives (||q - c|| - r)^2; for IP and cosine, -<q, x> is at least
+// -<q, c> - ||q|| r by Cauchy-Schwarz.
+float IndexIVFFlat::listLowerBound(int list, float centroid_distance, float query_norm) {
+    float radius = list_radii[list]; 
+    if (params.metric == Metric::L2) {
+        float gap = std::sqrt(std::max(centroid_distance, 0.0f)) - radius; 
+        return gap > 0 ? gap * gap : 0.0f; 
+    }
+    return centroid_distance - std::sqrt(query_norm) * radius; 
+}
 
-        for(int j = 0; j < k; j++) {
-            auto [distance, index] = actual_vectors.top(); 
-            actual_vectors.pop(); 
-            _results[i * k + j] = { index, distance }; 
+
+// True when params.prune_lists is set and no member of the list can beat the
+// current k-th best, so the scan can pass over it.
+bool IndexIVFFlat::canSkipList(int list, float centroid_distance, float query_norm, const TopK& top) {
+    return params.prune_lists && listLowerBound(list, centroid_distance, query_norm) > top.threshold(); 
+}
+
+
+// Euclidean distance from v to the centroid of its list, measured on v as the
+// list stores it: fp16/bf16 lists are decoded first (into buffer) so the
+// radius bounds what the scan actually sees.
+float IndexIVFFlat::centroidRadius(const float* v, int list, float* buffer) {
+    if (element_type == ElementType::FLOAT && params.precision != ListPrecision::FP32) {
+        for (int j = 0; j < dim; j++) {
+            buffer[j] = params.precision == ListPrecision::FP16 ? fp16ToFloat(floatToFp16(v[j])) : bf16ToFloat(floatToBf16(v[j])); 
         }
+        v = buffer; 
+    }
+    return std::sqrt(l2_kernel(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[list].data()), dim)); 
+}
+
+
+// Writes v into the next free lane of the list's last tile, opening a new
+// zero-filled tile when the last one is full.
+void IndexIVFFlat::appendToTiles(int list, const float* v) {
+    size_t position = inverted_list[list].size(); 
+    size_t tile_floats = (size_t)padded_dim * TILE_LANES; 
+    AlignedVector<float>& tiles = list_tiles[list]; 
+    if (position % TILE_LANES == 0) {
+        tiles.resize(tiles.size() + tile_floats, 0.0f); 
     }
+    float* tile = tiles.data() + position / TILE_LANES * tile_floats; 
+    int lane = position % TILE_LANES; 
+    for (int d = 0; d < dim; d++) {
+        tile[d * TILE_LANES + lane] = v[d]; 
+    }
+}
 
+
+// With spilling a vector can turn up in several probed lists, so the top-k
+// has to drop repeated ids.
+bool IndexIVFFlat::spilled() const {
+    return params.spill > 1; 
 }
 
 
-float IndexIVFFlat::euclideanDistance(const char* a, const char* b) {
-    ANNS::FloatL2DistanceHandler distance_handler; 
+bool IndexIVFFlat::usesNorms() const {
+    return params.store_norms && params.metric == Metric::L2 && element_type == ElementType::FLOAT; 
+}
+
+
+// ||x||^2 of a list vector as stored, so rounding to fp16/bf16 does not skew
+// the ranking. code is only read for the 16 bit precisions.
+float IndexIVFFlat::storedNorm(const float* v, const char* code) {
+    if (params.precision == ListPrecision::FP32) {
+        return simdKernels().ip_float(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(v), dim); 
+    }
+    const uint16_t* x = reinterpret_cast<const uint16_t*>(code); 
+    float norm = 0; 
+    for (int j = 0; j < dim; j++) {
+        float value = params.precision == ListPrecision::FP16 ? fp16ToFloat(x[j]) : bf16ToFloat(x[j]); 
+        norm += value * value; 
+    }
+    return norm; 
+}
 
-    float dist = distance_handler.compute(
-        a,
-        b,
-        dim
-    );
 
-    return dist; 
+// Orders the stored dimensions by decreasing variance over the training set,
+// so an early-abandoning scan accumulates the largest terms first.
+void IndexIVFFlat::orderDimsByVariance(size_t n, const KMeansReader& read) {
+    vector<double> sum(dim, 0.0), sum_squares(dim, 0.0); 
+    vector<float> x(dim); 
+    for (size_t i = 0; i < n; i++) {
+        read(i, x.data()); 
+        for (int d = 0; d < dim; d++) {
+            double value = x[d]; 
+            sum[d] += value; 
+            sum_squares[d] += value * value; 
+        }
+    }
+    vector<double> variance(dim); 
+    for (int d = 0; d < dim; d++) {
+        double mean = sum[d] / n; 
+        variance[d] = sum_squares[d] / n - mean * mean; 
+    }
+    dim_order.resize(dim); 
+    for (int d = 0; d < dim; d++) {
+        dim_order[d] = d; 
+    }
+    std::stable_sort(dim_order.begin(), dim_order.end(), [&](int a, int b) { return variance[a] > variance[b]; }); 
+}
+
+
+// Returns v in stored dimension order, written to out, or v itself when the
+// index keeps the input order.
+const float* IndexIVFFlat::permuteDims(const float* v, float* out) {
+    if (dim_order.empty()) {
+        return v; 
+    }
+    for (int d = 0; d < dim; d++) {
+        out[d] = v[dim_order[d]]; 
+    }
+    return out; 
+}
+
+
+// Smaller is closer for every metric: squared L2, or -<v, c> for IP and cosine.
+float IndexIVFFlat::centroidDistance(const float* v, int list) {
+    const char* c = reinterpret_cast<const char *>(centroids[list].data()); 
+    if (params.metric == Metric::L2) {
+        return l2_kernel(reinterpret_cast<const char *>(v), c, dim); 
+    }
+    return -centroid_ip_kernel(reinterpret_cast<const char *>(v), c, dim); 
+}
+
+
+void IndexIVFFlat::checkElementType(const std::shared_ptr<IStorage>& dataset) {
+    if (elementType(dataset) != element_type) {
+        throw std::invalid_argument("dataset element type does not match the trained index"); 
+    }
+}
+
+
+void IndexIVFFlat::encodeVector(const float* v, char* code) {
+    if (params.precision == ListPrecision::FP32) {
+        std::memcpy(code, v, code_size); 
+        return; 
+    }
+    uint16_t* out = reinterpret_cast<uint16_t*>(code); 
+    for (int j = 0; j < dim; j++) {
+        out[j] = params.precision == ListPrecision::FP16 ? floatToFp16(v[j]) : floatToBf16(v[j]); 
+    }
 }
 
 
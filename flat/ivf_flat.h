@@ -4,28 +4,167 @@
 #include <iostream> 
 #include <vector> 
 #include "../../include/storage.h"
+#include "../common/element_type.h"
+#include "../common/kernels.h"
+#include "../common/metric.h"
+#include "../common/aligned_allocator.h"
+#include "../common/topk.h"
+#include "../common/proximity_graph.h"
+#include "../common/kmeans.h"
+#include "../common/quantizer_cache.h"
+#include "probe_router.h"
 
 using namespace std; 
 using namespace ANNS; 
 
+// Element format of the vectors kept in the inverted lists. Queries and
+// centroids stay fp32; FP16 and BF16 halve the memory the list scan streams.
+// int8/uint8 datasets are always stored as bytes and ignore the precision.
+enum class ListPrecision { FP32, FP16, BF16 };
+
+// How the members of an inverted list are stored. ROWS keeps one contiguous
+// vector per member. TILED packs them into tiles of TILE_LANES vectors stored
+// dimension-major, so a tile is scored with aligned vertical SIMD and no
+// horizontal adds; it needs FP32 precision and float data.
+enum class ListLayout { ROWS, TILED };
+
+// Construction-time options, set field by field like faiss::ClusteringParameters.
+// The constructor rejects combinations that do not work together.
+struct IVFFlatParameters {
+    Metric metric = Metric::L2;                       // IP and COSINE return similarities, largest first
+    ListPrecision precision = ListPrecision::FP32;    // of float list vectors
+    ListLayout layout = ListLayout::ROWS;             // see ListLayout
+    bool store_norms = false;         // keep ||x||^2 and scan L2 by inner products: faster, less exact near q
+    bool early_abandon = false;       // stop a candidate's L2 once it passes the k-th best
+    bool permute_dims = false;        // store dims by decreasing training variance, for early_abandon
+    bool batch_by_list = false;       // query(): assign the batch, then stream each probed list once
+    int interleave = 0;               // query(): scan this many queries side by side, prefetching
+    int pipeline_threads = 0;         // query(): scan threads fed micro-batches by the assigning thread
+    int micro_batch = 256;            // queries per pipeline micro-batch
+    bool prune_lists = true;          // skip lists whose radius bound cannot beat the k-th best
+    bool sort_lists = false;          // keep lists sorted by centroid distance, scan only what can qualify
+    int min_nprobe = 1;               // lists probed before an adaptive stop
+    int max_nprobe = 0;               // lists probed at most, nprobe when 0
+    float probe_ratio = 0;            // stop when the next centroid is this times farther than the best hit
+    int probe_patience = 0;           // stop after this many lists in a row left the top-k unchanged
+    int coarse_graph_degree = 0;      // find nearest lists by a proximity graph over the centroids
+    int coarse_graph_beam = 64;       // beam width of the coarse graph search
+    int list_graph_threshold = 0;     // lists larger than this get their own graph instead of a scan
+    int list_graph_degree = 32;       // degree of those list graphs
+    int list_graph_beam = 128;        // beam width of a list graph search
+    int spill = 1;                    // lists each vector is stored in
+    float soar_lambda = 0;            // > 0 picks the extra lists SOAR-style, by orthogonal residuals
+    float max_list_ratio = 0;         // balance training so no list exceeds this times the average
+    bool cap_lists = false;           // hold add() to max_list_ratio too, overflowing to the next lists
+    KMeansParameters kmeans;          // coarse k-means; spherical and max_cluster_ratio are derived
+    std::string cache_dir;            // load or store the trained centroids here (see QuantizerCache)
+};
+
+
+// Where the last pipelined query() spent its time, in seconds. Scan times are
+// summed over the scan threads. The waits point at the bottleneck: assignment
+// blocked on a full queue means the scans are slower, idle scan threads mean
+// the assignment is.
+struct PipelineStats {
+    double total = 0; 
+    double assign = 0;           // coarse assignment, including the centroid GEMM
+    double assign_blocked = 0;   // assignment waiting for room in the queue
+    double scan = 0;             // list scans and top-k
+    double scan_idle = 0;        // scan threads waiting for a micro-batch
+    size_t micro_batches = 0; 
+};
+
 class IndexIVFFlat {
     public: 
-        IndexIVFFlat(int d, int np, int nl); 
+        IndexIVFFlat(int d, int np, int nl, const IVFFlatParameters& p = IVFFlatParameters()); 
         void train(std::shared_ptr<IStorage> dataset);
         void add(std::shared_ptr<IStorage> dataset); 
         void query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results); 
+        const PipelineStats& pipelineStats() const { return pipeline_stats; } 
+        void trainRouter(std::shared_ptr<IStorage> queries, const std::pair<IdxType, float>* gt, int gt_k, const RouterParameters& p = RouterParameters()); 
+        void saveRouter(const std::string& path) const { router.save(path); } 
+        void loadRouter(const std::string& path) { router.load(path); } 
+        size_t listBytes() const; 
+        size_t numEntries() const; 
+        size_t largestList() const; 
+        size_t numVectors() const { return num_vectors; } 
+        const KMeansStats& trainingStats() const { return training_stats; } 
+        bool loadedFromCache() const { return cache_hit; } 
 
     private: 
 
-        float euclideanDistance(const char* a, const char* b); 
+        float centroidDistance(const float* v, int list); 
+        void encodeVector(const float* v, char* code); 
+        void checkElementType(const std::shared_ptr<IStorage>& dataset); 
+        void appendToTiles(int list, const float* v); 
+        bool usesNorms() const; 
+        bool spilled() const; 
+        void assignLists(const float* v, vector<pair<float, int>>& ranked, vector<int>& lists); 
+        float storedNorm(const float* v, const char* code); 
+        void orderDimsByVariance(size_t n, const KMeansReader& read); 
+        const float* permuteDims(const float* v, float* out); 
+        void queryByList(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results); 
+        void queryInterleaved(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results); 
+        void queryPipelined(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results); 
+        void prepareQuery(const std::shared_ptr<IStorage>& dataset, int i, int k, vector<pair<float, int>>& ranked, vector<int>& probed, 
+                          vector<float>& probe_distances, float* scan_query, float* padded_query, float& query_norm); 
+        const float* queryAsFloat(const std::shared_ptr<IStorage>& dataset, int i, float* buffer); 
+        void selectProbes(vector<pair<float, int>>& ranked, int k, float query_norm, vector<int>& probed, vector<float>& probe_distances); 
+        void rankCentroids(const float* q, int wanted, vector<pair<float, int>>& ranked); 
+        int listsToRank() const; 
+        void buildCoarseGraph(); 
+        void routeProbes(vector<pair<float, int>>& ranked, int candidates, float query_norm); 
+        void routerFeatures(const vector<pair<float, int>>& ranked, int candidates, float query_norm, float* features); 
+        void scanProbes(const vector<int>& probed, const vector<float>& probe_distances, const char* query, const float* padded_query, float query_norm, 
+                        vector<float>& distances, TopK& top); 
+        int probeLimit() const; 
+        bool stopProbing(int probes, float centroid_distance, int unchanged, const TopK& top) const; 
+        void prepareScanQuery(const float* q, float* scan_query, float* padded_query, float& query_norm); 
+        void scanSortedList(int list, float centroid_distance, const char* query, const float* padded_query, float query_norm, vector<float>& distances, TopK& results); 
+        void sortList(int list); 
+        void buildListGraph(int list); 
+        void decodeMember(int list, size_t p, float* out); 
+        void searchListGraph(int list, const char* query, float query_norm, TopK& results); 
+        float memberDistance(int list, size_t p, const char* query, float query_norm); 
+        void scanList(int list, size_t begin, size_t end, const char* query, const float* padded_query, float query_norm, vector<float>& distances, TopK& results); 
+        void finishDistances(int list, size_t begin, size_t n, float query_norm, float* distances); 
+        float listLowerBound(int list, float centroid_distance, float query_norm); 
+        bool canSkipList(int list, float centroid_distance, float query_norm, const TopK& top); 
+        float centroidRadius(const float* v, int list, float* buffer); 
         vector<float> flattenDataset(const vector<vector<float>>& dataset);
         vector<vector<float>> convertToVectorOfVectors(const float* centroids, int k, int d);
         int dim; 
         int nprobe; 
         int nlist; 
-        vector<vector<float>> base_storage;
+        IVFFlatParameters params; 
+        ElementType element_type = ElementType::FLOAT; 
+        size_t code_size; 
+        DistanceKernel l2_kernel;     // fp32 vector against fp32 vector (centroids)
+        DistanceKernel centroid_ip_kernel; 
+        DistanceKernel list_kernel;   // query against a list vector in its stored format
+        DistanceKernel ip_kernel;     // same, inner product, used with stored norms
+        TileKernel tile_kernel; 
+        IpBlockKernel ip_block_kernel; 
+        EarlyAbandonKernel early_abandon_kernel; 
+        vector<int> dim_order;        // stored dimension j is input dimension dim_order[j]
+        int padded_dim; 
+        vector<vector<char>> list_codes;          // ROWS layout, members back to back
+        vector<AlignedVector<float>> list_tiles;  // TILED layout
+        vector<vector<float>> list_norms;         // ||x||^2 per member when usesNorms()
+        vector<float> list_radii;                 // farthest member from the centroid
+        vector<vector<float>> member_distances;   // per member, ascending, when sort_lists
         vector<vector<float>> centroids; 
+        vector<float> centroid_matrix;   // the centroids row after row, for the GEMM
+        vector<float> centroid_norms; 
+        PipelineStats pipeline_stats; 
+        KMeansStats training_stats;   // of the coarse k-means
+        bool cache_hit = false;       // the last train() loaded its centroids from cache_dir
+        ProbeRouter router; 
+        ProximityGraph coarse_graph;   // over the centroids, when coarse_graph_degree > 0
+        vector<ProximityGraph> list_graphs;   // empty except for lists over list_graph_threshold
         vector<vector<int>> inverted_list; 
+        size_t list_cap = 0;      // most members add() gives a list, 0 for no cap
+        size_t num_vectors = 0;   // added, each counted once however many lists hold it
 
 }; 
 
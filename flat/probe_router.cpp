@@ -0,0 +1,171 @@
+#include "probe_router.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+
+// Sanity limit for the hidden width read from a model file.
+static const int MAX_HIDDEN = 4096;
+
+
+void ProbeRouter::train(const vector<float>& features, const vector<float>& labels, int candidates, const RouterParameters& p) {
+    size_t n = labels.size();
+    if (n == 0 || features.size() != n * NUM_FEATURES) {
+        throw std::invalid_argument("router training needs one feature row per label");
+    }
+    hidden = p.hidden;
+    num_candidates = candidates;
+
+    mean.assign(NUM_FEATURES, 0.0f);
+    scale.assign(NUM_FEATURES, 1.0f);
+    for (int f = 0; f < NUM_FEATURES; f++) {
+        double sum = 0, sum_squares = 0;
+        for (size_t i = 0; i < n; i++) {
+            double value = features[i * NUM_FEATURES + f];
+            sum += value;
+            sum_squares += value * value;
+        }
+        double average = sum / n;
+        double deviation = std::sqrt(std::max(sum_squares / n - average * average, 0.0));
+        mean[f] = average;
+        scale[f] = deviation > 1e-12 ? 1.0 / deviation : 1.0;
+    }
+
+    std::mt19937 rng(p.seed);
+    int inputs = hidden > 0 ? hidden : NUM_FEATURES;
+    std::normal_distribution<float> init_hidden(0.0f, std::sqrt(2.0f / NUM_FEATURES));
+    std::normal_distribution<float> init_output(0.0f, std::sqrt(1.0f / inputs));
+    hidden_weights.resize((size_t)hidden * NUM_FEATURES);
+    for (float& w : hidden_weights) {
+        w = init_hidden(rng);
+    }
+    hidden_bias.assign(hidden, 0.0f);
+    output_weights.resize(inputs);
+    for (float& w : output_weights) {
+        w = init_output(rng);
+    }
+    output_bias = 0;
+
+    //few lists hold neighbours, so positives are weighted up to balance the classes
+    double positives = std::accumulate(labels.begin(), labels.end(), 0.0);
+    float positive_weight = positives > 0 ? (n - positives) / positives : 1.0f;
+
+    vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    vector<float> x(NUM_FEATURES), activation(hidden), hidden_grad(hidden);
+    for (int epoch = 0; epoch < p.epochs; epoch++) {
+        std::shuffle(order.begin(), order.end(), rng);
+        for (size_t i : order) {
+            for (int f = 0; f < NUM_FEATURES; f++) {
+                x[f] = (features[i * NUM_FEATURES + f] - mean[f]) * scale[f];
+            }
+            const float* input = x.data();
+            if (hidden > 0) {
+                for (int h = 0; h < hidden; h++) {
+                    float sum = hidden_bias[h];
+                    for (int f = 0; f < NUM_FEATURES; f++) {
+                        sum += hidden_weights[h * NUM_FEATURES + f] * x[f];
+                    }
+                    activation[h] = std::max(sum, 0.0f);
+                }
+                input = activation.data();
+            }
+            float logit = output_bias;
+            for (int j = 0; j < inputs; j++) {
+                logit += output_weights[j] * input[j];
+            }
+            float probability = 1.0f / (1.0f + std::exp(-logit));
+            float grad = (probability - labels[i]) * (labels[i] > 0 ? positive_weight : 1.0f) * p.learning_rate;
+
+            for (int h = 0; h < hidden; h++) {
+                hidden_grad[h] = activation[h] > 0 ? grad * output_weights[h] : 0.0f;
+            }
+            for (int j = 0; j < inputs; j++) {
+                output_weights[j] -= grad * input[j];
+            }
+            output_bias -= grad;
+            for (int h = 0; h < hidden; h++) {
+                for (int f = 0; f < NUM_FEATURES; f++) {
+                    hidden_weights[h * NUM_FEATURES + f] -= hidden_grad[h] * x[f];
+                }
+                hidden_bias[h] -= hidden_grad[h];
+            }
+        }
+    }
+}
+
+
+// Logit of the pair holding a true neighbour; only the order matters.
+float ProbeRouter::score(const float* features) const {
+    float x[NUM_FEATURES];
+    for (int f = 0; f < NUM_FEATURES; f++) {
+        x[f] = (features[f] - mean[f]) * scale[f];
+    }
+    if (hidden == 0) {
+        float logit = output_bias;
+        for (int f = 0; f < NUM_FEATURES; f++) {
+            logit += output_weights[f] * x[f];
+        }
+        return logit;
+    }
+    float logit = output_bias;
+    for (int h = 0; h < hidden; h++) {
+        float sum = hidden_bias[h];
+        for (int f = 0; f < NUM_FEATURES; f++) {
+            sum += hidden_weights[h * NUM_FEATURES + f] * x[f];
+        }
+        logit += output_weights[h] * std::max(sum, 0.0f);
+    }
+    return logit;
+}
+
+
+// Binary model file: hidden, candidates, then the parameters in member order.
+void ProbeRouter::save(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("cannot write router model " + path);
+    }
+    auto write = [&](const vector<float>& values) {
+        out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+    };
+    out.write(reinterpret_cast<const char*>(&hidden), sizeof(hidden));
+    out.write(reinterpret_cast<const char*>(&num_candidates), sizeof(num_candidates));
+    write(mean);
+    write(scale);
+    write(hidden_weights);
+    write(hidden_bias);
+    write(output_weights);
+    out.write(reinterpret_cast<const char*>(&output_bias), sizeof(output_bias));
+}
+
+
+void ProbeRouter::load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot read router model " + path);
+    }
+    auto read = [&](vector<float>& values, size_t n) {
+        values.resize(n);
+        in.read(reinterpret_cast<char*>(values.data()), n * sizeof(float));
+    };
+    in.read(reinterpret_cast<char*>(&hidden), sizeof(hidden));
+    in.read(reinterpret_cast<char*>(&num_candidates), sizeof(num_candidates));
+    if (!in || hidden < 0 || hidden > MAX_HIDDEN || num_candidates <= 0) {
+        num_candidates = 0;
+        throw std::runtime_error("corrupt router model " + path);
+    }
+    read(mean, NUM_FEATURES);
+    read(scale, NUM_FEATURES);
+    read(hidden_weights, (size_t)hidden * NUM_FEATURES);
+    read(hidden_bias, hidden);
+    read(output_weights, hidden > 0 ? hidden : NUM_FEATURES);
+    in.read(reinterpret_cast<char*>(&output_bias), sizeof(output_bias));
+    if (!in) {
+        num_candidates = 0;
+        throw std::runtime_error("corrupt router model " + path);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef PROBE_ROUTER_H
+#define PROBE_ROUTER_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+// Training options of the probe router. hidden = 0 gives a linear model.
+// candidates is how many of the nearest lists (by centroid distance) the
+// router re-ranks per query; 0 means four times the probe limit.
+struct RouterParameters {
+    int hidden = 16;
+    int candidates = 0;
+    int epochs = 20;
+    float learning_rate = 0.01f;
+    unsigned seed = 1234;
+};
+
+
+// Learned probe ordering. Scores a (query, list) pair from a few features of
+// the coarse ranking with a small MLP, trained offline with a logistic loss
+// to predict whether the list holds one of the query's true neighbours.
+// Features are standardised with the training mean and deviation.
+class ProbeRouter {
+    public:
+        // rank in the candidate window, gap to the nearest centroid (relative
+        // and within the window), log list size, how far the list radius
+        // opens the list, and the gap between the two nearest centroids
+        static constexpr int NUM_FEATURES = 6;
+
+        // features holds one row of NUM_FEATURES per sample, labels 0 or 1.
+        void train(const vector<float>& features, const vector<float>& labels, int candidates, const RouterParameters& p);
+        float score(const float* features) const;
+        bool trained() const { return num_candidates > 0; }
+        int candidates() const { return num_candidates; }
+        void save(const std::string& path) const;
+        void load(const std::string& path);
+
+    private:
+        int hidden = 0;
+        int num_candidates = 0;
+        vector<float> mean;
+        vector<float> scale;
+        vector<float> hidden_weights;   // hidden rows of NUM_FEATURES
+        vector<float> hidden_bias;
+        vector<float> output_weights;   // hidden entries, NUM_FEATURES when linear
+        float output_bias = 0;
+};
+
+
+#endif
@@ -1,18 +1,33 @@
 #include "ivf_pq.h"
 #include <cmath> 
-#include "../../include/distance.h"
+#include "../common/kernels.h"
+#include "../common/element_type.h"
+#include "../common/topk.h"
 #include <random>
 #include <algorithm>  // for std::shuffle
 #include <queue> 
-#include <faiss/Clustering.h>
-#include <faiss/IndexFlat.h>  // needed as a temporary quantizer
+#include <stdexcept>
+#include <cstring>
 
 using namespace std; 
 
-IndexIVFPQ::IndexIVFPQ(int d, int np, int nl, int b, int m) : dim(d), nprobe(np), nlist(nl), nbits(b), m_val(m) {
+IndexIVFPQ::IndexIVFPQ(int d, int np, int nl, int b, int m, Metric mt, const KMeansParameters& kp, const std::string& cache) 
+    : dim(d), nprobe(np), nlist(nl), nbits(b), m_val(m), metric(mt), kmeans_params(kp), cache_dir(cache) {
     inverted_list.resize(nlist); 
     centroids.resize(nlist); 
     codebooks.resize(m); 
+
+    //codes are stored one byte per sub-quantizer
+    if (nbits < 1 || nbits > 8) {
+        throw std::invalid_argument("IndexIVFPQ supports 1 to 8 bits per sub-quantizer"); 
+    }
+    ksub = 1 << nbits; 
+
+    //full vectors and sub-vectors each get their kernel once, here
+    l2_kernel = selectL2Kernel(dim); 
+    sub_kernel = selectL2Kernel(dim / m_val); 
+    ip_kernel = simdKernels().ip_float; 
+    adc_kernel = simdKernels().adc; 
 }
 
 
@@ -20,69 +35,89 @@ void IndexIVFPQ::train(std::shared_ptr<IStorage> dataset) {
     //create coarse centroids 
     int k = pow(2, nbits); 
 
-    auto float_storage = std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset);
-
-    faiss::ClusteringParameters cp; 
-    cp.verbose = false; 
-    cp.niter = 20; 
-    faiss::Clustering clus(dim, nlist, cp);
-    faiss::IndexFlatL2 quantizer(dim);
-    vector<float> data; 
-    data.reserve(float_storage->get_num_points()); 
-    for(int i = 0; i < float_storage->get_num_points(); i++) {
-        float* v = reinterpret_cast<float*>(float_storage->get_vector(i));
-        data.insert(data.end(), v, v + dim);
-    }
-
-
-    clus.train(float_storage->get_num_points(), data.data(), quantizer);
-    centroids = convertToVectorOfVectors(clus.centroids.data(), nlist, dim); 
-
-    vector<vector<vector<float>>> subspaces(m_val); 
-    //create codebooks 
-
-
-    //split every vector into M subspaces
-    for (int i = 0; i < float_storage->get_num_points(); i++) {
-        float* vec = reinterpret_cast<float*>(float_storage->get_vector(i)); 
-        for (int m = 0; m < m_val; ++m) {
-
-            int offset = m * (dim / m_val);
-            vector<float> subvec(vec + offset, vec + offset + (dim / m_val));
-            subspaces.at(m).push_back(subvec);
+    //byte datasets are widened to float for training and encoding only
+    element_type = elementType(dataset); 
+
+    //IP and cosine cluster on the unit sphere; the PQ codebooks stay L2 k-means
+    //since they only have to reconstruct the vectors
+    KMeansParameters kp = kmeans_params; 
+    kp.spherical = metric != Metric::L2; 
+    KMeansReader read = [&](size_t i, float* out) {
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, out); 
+        if (metric == Metric::COSINE) {
+            normalizeVector(v, out, dim); 
+        } else if (v != out) {
+            std::memcpy(out, v, dim * sizeof(float)); 
+        }
+    }; 
+    int sub_dim = dim / m_val; 
+    KMeansParameters sub_kp = kmeans_params; 
+    sub_kp.max_cluster_ratio = 0; 
+
+    //one entry holds the coarse centroids followed by the m_val codebooks; the metric is keyed
+    //on its own because only cosine normalizes what both are trained on
+    QuantizerCache cache(cache_dir); 
+    CacheKey key("ivf_pq"); 
+    if (!cache_dir.empty()) {
+        key.add(dim).add(nlist).add(nbits).add(m_val).add(metric).add(kp).add(sub_kp).addDataset(dataset, element_type, dim); 
+        vector<vector<float>> entry; 
+        vector<size_t> sizes(m_val + 1, (size_t)k * sub_dim); 
+        sizes[0] = (size_t)nlist * dim; 
+        if (cache.load(key, sizes, entry)) {
+            centroids = convertToVectorOfVectors(entry[0].data(), nlist, dim); 
+            for (int m = 0; m < m_val; m++) {
+                codebooks[m] = convertToVectorOfVectors(entry[m + 1].data(), k, sub_dim); 
+            }
+            training_stats = KMeansStats(); 
+            codebook_stats.clear(); 
+            cache_hit = true; 
+            return; 
         }
     }
 
-
-    //perform k means clustering on every subspace 
-    for(int i = 0; i < subspaces.size(); i++) {
-        vector<vector<float>> subspace = subspaces[i];
-        vector<vector<float>> mth_centroid_list; 
-        faiss::ClusteringParameters cp; 
-        cp.verbose = false; 
-        cp.niter = 20; 
-        int sub_dim = subspace[0].size();  
-        faiss::Clustering clus(sub_dim, k, cp);
-        faiss::IndexFlatL2 quantizer(sub_dim);
-
-        std::vector<float> flat_data = flattenDataset(subspace);
-        clus.train(subspace.size(), flat_data.data(), quantizer);
-        mth_centroid_list = convertToVectorOfVectors(clus.centroids.data(), nlist, sub_dim); 
-        codebooks[i] = mth_centroid_list; 
+    cache_hit = false; 
+    KMeans clustering(dim, nlist, kp); 
+    clustering.train(dataset->get_num_points(), read); 
+    training_stats = clustering.stats(); 
+    centroids = convertToVectorOfVectors(clustering.centroids().data(), nlist, dim); 
+    vector<vector<float>> entry = {clustering.centroids()}; 
+
+    //perform k means clustering on every subspace, reading the sub-vectors straight from the dataset
+    codebook_stats.resize(m_val); 
+    for (int m = 0; m < m_val; m++) {
+        KMeans sub_clustering(sub_dim, k, sub_kp); 
+        sub_clustering.train(dataset->get_num_points(), [&](size_t i, float* out) {
+            thread_local vector<float> row; 
+            row.resize(dim); 
+            read(i, row.data()); 
+            std::memcpy(out, row.data() + m * sub_dim, sub_dim * sizeof(float)); 
+        }); 
+        codebooks[m] = convertToVectorOfVectors(sub_clustering.centroids().data(), k, sub_dim); 
+        codebook_stats[m] = sub_clustering.stats(); 
+        entry.push_back(sub_clustering.centroids()); 
+    }
+    if (!cache_dir.empty()) {
+        cache.save(key, entry); 
     }
 }
 
 
 void IndexIVFPQ::add(std::shared_ptr<IStorage> dataset) {
-    auto float_storage = std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset);
-    base_storage.reserve(float_storage->get_num_points());
+    checkElementType(dataset); 
+    base_storage.reserve(dataset->get_num_points());
+    vector<float> buffer(dim); 
+    vector<float> normalized(dim); 
     //assign every vector to a coarse vector
-    for(int i = 0; i < float_storage->get_num_points(); i++) {
+    for(int i = 0; i < dataset->get_num_points(); i++) {
         int best_index = 0; 
-        float* v = reinterpret_cast<float*>(float_storage->get_vector(i));
-        float best_distance = euclideanDistance(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[0].data()), dim);
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, buffer.data());
+        if (metric == Metric::COSINE) {
+            normalizeVector(v, normalized.data(), dim); 
+            v = normalized.data(); 
+        }
+        float best_distance = centroidDistance(v, 0);
         for(int j = 1; j < centroids.size(); j++) {
-            float distance = euclideanDistance(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[j].data()), dim);
+            float distance = centroidDistance(v, j);
             if(distance < best_distance) {
                 best_distance = distance; 
                 best_index = j; 
@@ -92,7 +127,7 @@ void IndexIVFPQ::add(std::shared_ptr<IStorage> dataset) {
 
 
         //create compressed vector 
-        vector<float> compressed_vector;
+        vector<uint8_t> compressed_vector;
 
         for (int m = 0; m < m_val; ++m) {
 
@@ -100,14 +135,14 @@ void IndexIVFPQ::add(std::shared_ptr<IStorage> dataset) {
             int offset = m * (dim / m_val);
             vector<float> subvec(v + offset, v + offset + (dim / m_val));
             
-            vector<vector<float>> mth_centroid_list = codebooks[m]; 
+            const vector<vector<float>>& mth_centroid_list = codebooks[m]; 
 
  
 
             int centroid_index = 0; 
-            float best_centroid_distance = euclideanDistance(reinterpret_cast<const char *>(subvec.data()), reinterpret_cast<const char *>(mth_centroid_list[0].data()), dim / m_val); 
+            float best_centroid_distance = sub_kernel(reinterpret_cast<const char *>(subvec.data()), reinterpret_cast<const char *>(mth_centroid_list[0].data()), dim / m_val); 
             for(int j = 0; j < mth_centroid_list.size(); j++) {
-                float distance = euclideanDistance(reinterpret_cast<const char *>(subvec.data()), reinterpret_cast<const char *>(mth_centroid_list[j].data()), dim / m_val); 
+                float distance = sub_kernel(reinterpret_cast<const char *>(subvec.data()), reinterpret_cast<const char *>(mth_centroid_list[j].data()), dim / m_val); 
                 if(distance < best_centroid_distance) {
                     best_centroid_distance = distance; 
                     centroid_index = j; 
@@ -134,56 +169,73 @@ struct Compare {
 };
 
 void IndexIVFPQ::query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
-    auto float_storage = std::dynamic_pointer_cast<ANNS::Storage<float>>(dataset);
+    checkElementType(dataset); 
     std::pair<IdxType, float>* _results = results; 
-    for(int i = 0; i < float_storage->get_num_points(); i++) {
-        float* v = reinterpret_cast<float*>(float_storage->get_vector(i));
+    vector<float> buffer(dim); 
+    vector<float> table(m_val * ksub); 
+    vector<float> distances; 
+    vector<float> normalized(dim); 
+    for(int i = 0; i < dataset->get_num_points(); i++) {
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, buffer.data());
+        if (metric == Metric::COSINE) {
+            normalizeVector(v, normalized.data(), dim); 
+            v = normalized.data(); 
+        }
         std::priority_queue<Pair, std::vector<Pair>, Compare> pq;
         for(int j = 0; j < centroids.size(); j++) {
-            pq.push({euclideanDistance(reinterpret_cast<const char *>(centroids.at(j).data()), reinterpret_cast<const char *>(v), dim), j}); 
+            pq.push({centroidDistance(v, j), j}); 
         }
 
-        std::priority_queue<Pair, std::vector<Pair>, Compare> actual_vectors;
+        computeTable(v, table.data()); 
+
+        TopK actual_vectors(k); 
 
-        for(int j = 0; j < nprobe; j++) {
+        for(int j = 0; j < nprobe && !pq.empty(); j++) {
             auto [distance, index] = pq.top(); 
             pq.pop(); 
-            vector<int> centroid_vectors = inverted_list[index]; 
-            for(int indexes : centroid_vectors) {
-                vector<float> compressed_vector = base_storage[indexes]; 
-                float calculated_distance = 0; 
-
-                for(int m = 0; m < m_val; m++) {
-                    int offset = m * (dim / m_val);
-                    vector<float> subvec(v + offset, v + offset + (dim / m_val));
-
-                    calculated_distance += euclideanDistance(reinterpret_cast<const char *>(codebooks[m][compressed_vector[m]].data()), reinterpret_cast<const char *>(subvec.data()), dim / m_val); 
-                }
-                actual_vectors.push({calculated_distance, indexes}); 
+            const vector<int>& centroid_vectors = inverted_list[index]; 
+            distances.resize(centroid_vectors.size()); 
+            for(size_t p = 0; p < centroid_vectors.size(); p++) {
+                distances[p] = adc_kernel(table.data(), base_storage[centroid_vectors[p]].data(), m_val, ksub); 
             }
+            actual_vectors.push(distances.data(), centroid_vectors.data(), centroid_vectors.size()); 
         }
 
+        actual_vectors.extract(_results + i * k, metric != Metric::L2); 
+    }
+}
 
 
-        for(int j = 0; j < k; j++) {
-            auto [distance, index] = actual_vectors.top(); 
-            actual_vectors.pop(); 
-            _results[i * k + j] = { index, distance }; 
-        }
+// Smaller is closer for every metric: squared L2, or -<v, c> for IP and cosine.
+float IndexIVFPQ::centroidDistance(const float* v, int list) {
+    const char* c = reinterpret_cast<const char *>(centroids[list].data()); 
+    if (metric == Metric::L2) {
+        return l2_kernel(reinterpret_cast<const char *>(v), c, dim); 
     }
+    return -ip_kernel(reinterpret_cast<const char *>(v), c, dim); 
 }
 
 
-float IndexIVFPQ::euclideanDistance(const char* a, const char* b, int dimension) {
-    ANNS::FloatL2DistanceHandler distance_handler; 
+// Distance of every query sub-vector to every codeword, so that each code
+// costs m_val table lookups. For IP and cosine the entries are -<q_m, c>, so
+// the same ADC kernel sums them to -<q, x>.
+void IndexIVFPQ::computeTable(const float* q, float* table) {
+    int sub_dim = dim / m_val; 
+    DistanceKernel kernel = metric == Metric::L2 ? sub_kernel : ip_kernel; 
+    float sign = metric == Metric::L2 ? 1.0f : -1.0f; 
+    for(int m = 0; m < m_val; m++) {
+        const char* sub_query = reinterpret_cast<const char *>(q + m * sub_dim); 
+        for(int c = 0; c < ksub; c++) {
+            table[m * ksub + c] = sign * kernel(reinterpret_cast<const char *>(codebooks[m][c].data()), sub_query, sub_dim); 
+        }
+    }
+}
 
-    float dist = distance_handler.compute(
-        a,
-        b,
-        dimension
-    );
 
-    return dist; 
+void IndexIVFPQ::checkElementType(const std::shared_ptr<IStorage>& dataset) {
+    if (elementType(dataset) != element_type) {
+        throw std::invalid_argument("dataset element type does not match the trained index"); 
+    }
 }
 
 
@@ -4,20 +4,35 @@
 #include <iostream> 
 #include <vector> 
 #include "../../include/storage.h"
+#include "../common/element_type.h"
+#include "../common/kernels.h"
+#include "../common/metric.h"
+#include "../common/kmeans.h"
+#include "../common/quantizer_cache.h"
 
 using namespace std; 
 using namespace ANNS; 
 
+// kp configures the k-means of both the coarse quantizer and the PQ
+// codebooks; the coarse one is spherical for IP and cosine. With cache_dir
+// set, train() keeps the centroids and codebooks there and loads them back
+// when the training set and options match (see QuantizerCache).
 class IndexIVFPQ {
     public: 
-        IndexIVFPQ(int d, int np, int nl, int b, int m); 
+        IndexIVFPQ(int d, int np, int nl, int b, int m, Metric mt = Metric::L2, const KMeansParameters& kp = KMeansParameters(),
+                   const std::string& cache_dir = ""); 
         void train(std::shared_ptr<IStorage> dataset);
         void add(std::shared_ptr<IStorage> dataset); 
         void query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results);
+        const KMeansStats& trainingStats() const { return training_stats; } 
+        const vector<KMeansStats>& codebookStats() const { return codebook_stats; } 
+        bool loadedFromCache() const { return cache_hit; } 
 
     private: 
 
-        float euclideanDistance(const char* a, const char* b, int dimension); 
+        void checkElementType(const std::shared_ptr<IStorage>& dataset); 
+        float centroidDistance(const float* v, int list); 
+        void computeTable(const float* q, float* table); 
         vector<float> flattenDataset(const vector<vector<float>>& dataset);
         vector<vector<float>> convertToVectorOfVectors(const float* centroids, int k, int d);
         int dim; 
@@ -25,7 +40,19 @@ class IndexIVFPQ {
         int nlist; 
         int nbits; 
         int m_val; 
-        vector<vector<float>> base_storage; 
+        Metric metric; 
+        KMeansParameters kmeans_params; 
+        std::string cache_dir; 
+        KMeansStats training_stats;              // coarse k-means
+        vector<KMeansStats> codebook_stats;      // one per sub-quantizer
+        bool cache_hit = false;                  // the last train() loaded everything from cache_dir
+        ElementType element_type = ElementType::FLOAT; 
+        DistanceKernel l2_kernel;    // full dim vectors (coarse centroids)
+        DistanceKernel sub_kernel;   // dim / m_val sub-vectors (codebooks)
+        DistanceKernel ip_kernel;    // IP and cosine, any length
+        AdcKernel adc_kernel;        // table lookups for the list scan
+        int ksub; 
+        vector<vector<uint8_t>> base_storage; 
         vector<vector<float>> centroids; 
         vector<vector<int>> inverted_list; 
         vector<vector<vector<float>>> codebooks;
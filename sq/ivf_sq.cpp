@@ -0,0 +1,164 @@
+#include "ivf_sq.h"
+#include "../common/kernels.h"
+#include "../common/element_type.h"
+#include "../common/topk.h"
+#include <cmath> 
+#include <algorithm>
+#include <limits> 
+#include <queue> 
+#include <stdexcept> 
+#include <cstring>
+
+using namespace std;
+using namespace ANNS;  
+
+
+IndexIVFScalarQuantizer::IndexIVFScalarQuantizer(int d, int np, int nl, int b) : dim(d), nprobe(np), nlist(nl), nbits(b) {
+    inverted_list.resize(nlist); 
+    list_codes.resize(nlist); 
+    centroids.resize(nlist); 
+    switch (nbits) {
+        case 8: code_distance = simdKernels().l2_sq8; break; 
+        case 6: code_distance = simdKernels().l2_sq6; break; 
+        case 4: code_distance = simdKernels().l2_sq4; break; 
+        default: throw std::invalid_argument("IndexIVFScalarQuantizer supports 8, 6 or 4 bits"); 
+    }
+    code_size = (dim * nbits + 7) / 8; 
+    l2_kernel = selectL2Kernel(dim); 
+}
+
+
+void IndexIVFScalarQuantizer::train(std::shared_ptr<IStorage> dataset) {
+    //byte datasets are widened to float for training and encoding only
+    element_type = elementType(dataset); 
+
+    //coarse centroids, same as IndexIVFFlat
+    KMeans clustering(dim, nlist); 
+    KMeansReader read = [&](size_t i, float* out) {
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, out); 
+        if (v != out) {
+            std::memcpy(out, v, dim * sizeof(float)); 
+        }
+    }; 
+    clustering.train(dataset->get_num_points(), read); 
+    centroids = convertToVectorOfVectors(clustering.centroids().data(), nlist, dim); 
+
+    //per dimension ranges of the scalar quantizer
+    vmin.assign(dim, std::numeric_limits<float>::max()); 
+    vector<float> vmax(dim, std::numeric_limits<float>::lowest()); 
+    vector<float> buffer(dim); 
+    for(int i = 0; i < dataset->get_num_points(); i++) {
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, buffer.data()); 
+        for(int j = 0; j < dim; j++) {
+            vmin[j] = std::min(vmin[j], v[j]); 
+            vmax[j] = std::max(vmax[j], v[j]); 
+        }
+    }
+    int levels = (1 << nbits) - 1; 
+    scale.resize(dim); 
+    for(int j = 0; j < dim; j++) {
+        scale[j] = (vmax[j] - vmin[j]) / levels; 
+    }
+}
+
+
+void IndexIVFScalarQuantizer::add(std::shared_ptr<IStorage> dataset) {
+    checkElementType(dataset); 
+    vector<uint8_t> code(code_size); 
+    vector<float> buffer(dim); 
+    for(int i = 0; i < dataset->get_num_points(); i++) {
+        int best_index = 0; 
+        const float* v = vectorAsFloat(dataset, element_type, i, dim, buffer.data());
+        float best_distance = euclideanDistance(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[0].data())); 
+        for(int j = 1; j < centroids.size(); j++) {
+            float distance = euclideanDistance(reinterpret_cast<const char *>(v), reinterpret_cast<const char *>(centroids[j].data())); 
+            if(distance < best_distance) {
+                best_distance = distance; 
+                best_index = j; 
+            }
+        }
+
+        encodeVector(v, code.data()); 
+        list_codes[best_index].insert(list_codes[best_index].end(), code.begin(), code.end()); 
+        inverted_list[best_index].push_back(i); 
+    }
+}
+
+
+using Pair = std::pair<float, int>;
+
+struct Compare {
+    bool operator()(const Pair& a, const Pair& b) {
+        return a.first > b.first;  // Smallest value first
+    }
+};
+
+void IndexIVFScalarQuantizer::query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results) {
+    checkElementType(dataset); 
+    std::pair<IdxType, float>* _results = results; 
+    vector<float> buffer(dim); 
+    vector<float> distances; 
+    for(int i = 0; i < dataset->get_num_points(); i++) {
+        const float* q = vectorAsFloat(dataset, element_type, i, dim, buffer.data()); 
+        std::priority_queue<Pair, std::vector<Pair>, Compare> pq;
+        for(int j = 0; j < centroids.size(); j++) {
+            pq.push(std::make_pair(
+                euclideanDistance(reinterpret_cast<const char *>(centroids[j].data()),
+                    reinterpret_cast<const char *>(q)),
+                j));
+        }
+
+        TopK actual_vectors(k); 
+
+        for(int j = 0; j < nprobe && !pq.empty(); j++) {
+            auto [distance, index] = pq.top(); 
+            pq.pop(); 
+            const vector<int>& ids = inverted_list[index]; 
+            const uint8_t* code = list_codes[index].data(); 
+            distances.resize(ids.size()); 
+            for (size_t p = 0; p < ids.size(); p++, code += code_size) {
+                distances[p] = code_distance(q, code, vmin.data(), scale.data(), dim); 
+            }
+            actual_vectors.push(distances.data(), ids.data(), ids.size()); 
+        }
+
+        actual_vectors.extract(_results + i * k); 
+    }
+}
+
+
+void IndexIVFScalarQuantizer::checkElementType(const std::shared_ptr<IStorage>& dataset) {
+    if (elementType(dataset) != element_type) {
+        throw std::invalid_argument("dataset element type does not match the trained index"); 
+    }
+}
+
+
+// Maps every dimension onto [0, 2^nbits - 1], rounding to the nearest level.
+void IndexIVFScalarQuantizer::encodeVector(const float* v, uint8_t* code) {
+    int levels = (1 << nbits) - 1; 
+    std::fill(code, code + code_size, 0); 
+    for(int j = 0; j < dim; j++) {
+        float level = scale[j] > 0 ? std::round((v[j] - vmin[j]) / scale[j]) : 0; 
+        level = std::min(std::max(level, 0.0f), (float)levels); 
+        sqSetCode(code, j, nbits, (uint8_t)level); 
+    }
+}
+
+
+float IndexIVFScalarQuantizer::euclideanDistance(const char* a, const char* b) {
+    return l2_kernel(a, b, dim); 
+}
+
+
+vector<vector<float>> IndexIVFScalarQuantizer::convertToVectorOfVectors(const float* centroids, int k, int d) {
+    vector<vector<float>> result(k, vector<float>(d));
+
+    for (int i = 0; i < k; ++i) {
+        for (int j = 0; j < d; ++j) {
+            result[i][j] = centroids[i * d + j];
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,48 @@
+#ifndef IVFSQ_H
+#define IVFSQ_H
+
+#include <iostream> 
+#include <vector> 
+#include <cstdint> 
+#include "../../include/storage.h"
+#include "../common/element_type.h"
+#include "../common/kernels.h"
+#include "../common/kmeans.h"
+
+using namespace std; 
+using namespace ANNS; 
+
+// IVF index whose lists hold scalar quantized vectors: every dimension is
+// mapped onto nbits (8, 6 or 4) using the per-dimension [min, max] range
+// learned at train().
+class IndexIVFScalarQuantizer {
+    public: 
+        IndexIVFScalarQuantizer(int d, int np, int nl, int b = 8); 
+        void train(std::shared_ptr<IStorage> dataset);
+        void add(std::shared_ptr<IStorage> dataset); 
+        void query(std::shared_ptr<IStorage> dataset, int k, std::pair<IdxType, float>* results); 
+
+    private: 
+
+        float euclideanDistance(const char* a, const char* b); 
+        void encodeVector(const float* v, uint8_t* code); 
+        void checkElementType(const std::shared_ptr<IStorage>& dataset); 
+        vector<vector<float>> convertToVectorOfVectors(const float* centroids, int k, int d);
+        int dim; 
+        int nprobe; 
+        int nlist; 
+        int nbits; 
+        ElementType element_type = ElementType::FLOAT; 
+        size_t code_size; 
+        DistanceKernel l2_kernel; 
+        SqKernel code_distance; 
+        vector<float> vmin; 
+        vector<float> scale; 
+        vector<vector<float>> centroids; 
+        vector<vector<int>> inverted_list; 
+        vector<vector<uint8_t>> list_codes; 
+
+}; 
+
+
+#endif
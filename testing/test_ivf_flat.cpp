@@ -1,9 +1,13 @@
 #include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <numeric>
+#include <random>
 #include <boost/program_options.hpp>
+#include <unistd.h>
 #include "../flat/ivf_flat.h"
+#include "../common/reservoir_sampler.h"
 #include "../../include/utils.h"
 
 namespace po = boost::program_options;
@@ -11,8 +15,15 @@ namespace po = boost::program_options;
 
 
 int main(int argc, char** argv) {
-    std::string data_type, dist_fn, base_bin_file, query_bin_file, train_bin_file, base_label_file, query_label_file, train_label_file, gt_file, index_path_prefix;
-    ANNS::IdxType K, Dim, Nprobe, Nlist;
+    std::string data_type, dist_fn, precision, layout, base_bin_file, query_bin_file, train_bin_file, base_label_file, query_label_file, train_label_file, gt_file, index_path_prefix, cache_dir, router_query_file, router_label_file, router_gt_file, router_model;
+    Metric metric = Metric::L2;
+    ANNS::IdxType K, Dim, Nprobe, Nlist, Interleave, Pipeline_threads, Micro_batch, Min_nprobe, Max_nprobe, Probe_patience, Router_K, Router_hidden, Coarse_graph_degree, Coarse_graph_beam, List_graph_threshold, List_graph_degree, List_graph_beam, Spill, Kmeans_iterations, Kmeans_refine;
+    size_t kmeans_batch_size, max_points_per_centroid, train_sample_size;
+    std::string kmeans_seeding;
+    float kmeans_tolerance;
+    bool kmeans_hierarchical;
+    float probe_ratio, soar_lambda, max_list_ratio;
+    bool store_norms, early_abandon, permute_dims, batch_by_list, prune_lists, sort_lists, cap_lists;
 
     try {
         po::options_description desc{"Arguments"};
@@ -45,6 +56,84 @@ int main(int argc, char** argv) {
                            "Number of clusters to create");
         desc.add_options()("dim", po::value<ANNS::IdxType>(&Dim)->required(),
                            "Number of dimensions");
+        desc.add_options()("precision", po::value<std::string>(&precision)->default_value("fp32"),
+                           "Precision of the vectors stored in the lists <fp32/fp16/bf16>");
+        desc.add_options()("layout", po::value<std::string>(&layout)->default_value("rows"),
+                           "Layout of the vectors stored in the lists <rows/tiled>");
+        desc.add_options()("store_norms", po::value<bool>(&store_norms)->default_value(false),
+                           "Keep ||x||^2 per list vector and scan with inner products, faster but less exact <true/false>");
+        desc.add_options()("early_abandon", po::value<bool>(&early_abandon)->default_value(false),
+                           "Stop a candidate's distance once it passes the k-th best; needs store_norms false <true/false>");
+        desc.add_options()("permute_dims", po::value<bool>(&permute_dims)->default_value(false),
+                           "Store dimensions by decreasing variance for early abandoning <true/false>");
+        desc.add_options()("batch_by_list", po::value<bool>(&batch_by_list)->default_value(false),
+                           "Scan each probed list once for the whole query batch <true/false>");
+        desc.add_options()("interleave", po::value<ANNS::IdxType>(&Interleave)->default_value(0),
+                           "Number of queries whose list scans are interleaved with prefetching, 0 for none");
+        desc.add_options()("pipeline_threads", po::value<ANNS::IdxType>(&Pipeline_threads)->default_value(0),
+                           "Number of scan threads of the pipelined batch search, 0 for none");
+        desc.add_options()("micro_batch", po::value<ANNS::IdxType>(&Micro_batch)->default_value(256),
+                           "Queries per micro-batch of the pipelined batch search");
+        desc.add_options()("prune_lists", po::value<bool>(&prune_lists)->default_value(true),
+                           "Skip probed lists whose radius bound cannot beat the k-th best <true/false>");
+        desc.add_options()("sort_lists", po::value<bool>(&sort_lists)->default_value(false),
+                           "Sort lists by centroid distance and scan only the part that can hold neighbours <true/false>");
+        desc.add_options()("min_nprobe", po::value<ANNS::IdxType>(&Min_nprobe)->default_value(1),
+                           "Lists every query visits before adaptive probing may stop it");
+        desc.add_options()("max_nprobe", po::value<ANNS::IdxType>(&Max_nprobe)->default_value(0),
+                           "Most lists a query visits, 0 for nprobe");
+        desc.add_options()("probe_ratio", po::value<float>(&probe_ratio)->default_value(0),
+                           "Stop probing once the next centroid is this many times farther than the best candidate, 0 for off");
+        desc.add_options()("probe_patience", po::value<ANNS::IdxType>(&Probe_patience)->default_value(0),
+                           "Stop probing once this many lists in a row left the top-k unchanged, 0 for off");
+        desc.add_options()("router_query_file", po::value<std::string>(&router_query_file)->default_value(""),
+                           "Queries in binary format to train the probe router on, empty for no router");
+        desc.add_options()("router_label_file", po::value<std::string>(&router_label_file)->default_value(""),
+                           "Label file of the router training queries");
+        desc.add_options()("router_gt_file", po::value<std::string>(&router_gt_file)->default_value(""),
+                           "Ground truth of the router training queries in binary format");
+        desc.add_options()("router_K", po::value<ANNS::IdxType>(&Router_K)->default_value(10),
+                           "Neighbours per router training query in its ground truth");
+        desc.add_options()("router_hidden", po::value<ANNS::IdxType>(&Router_hidden)->default_value(16),
+                           "Hidden units of the probe router, 0 for a linear model");
+        desc.add_options()("router_model", po::value<std::string>(&router_model)->default_value(""),
+                           "Probe router file: written after training, or loaded when there are no training queries");
+        desc.add_options()("coarse_graph_degree", po::value<ANNS::IdxType>(&Coarse_graph_degree)->default_value(0),
+                           "Degree of the proximity graph over the centroids, 0 to compare against every centroid");
+        desc.add_options()("coarse_graph_beam", po::value<ANNS::IdxType>(&Coarse_graph_beam)->default_value(64),
+                           "Beam width of the coarse graph search");
+        desc.add_options()("list_graph_threshold", po::value<ANNS::IdxType>(&List_graph_threshold)->default_value(0),
+                           "Lists with more members get a proximity graph searched instead of scanned, 0 for none");
+        desc.add_options()("list_graph_degree", po::value<ANNS::IdxType>(&List_graph_degree)->default_value(32),
+                           "Degree of the per-list proximity graphs");
+        desc.add_options()("list_graph_beam", po::value<ANNS::IdxType>(&List_graph_beam)->default_value(128),
+                           "Beam width of the per-list graph search");
+        desc.add_options()("spill", po::value<ANNS::IdxType>(&Spill)->default_value(1),
+                           "Number of lists each base vector is stored in");
+        desc.add_options()("soar_lambda", po::value<float>(&soar_lambda)->default_value(0),
+                           "Weight of the SOAR orthogonality term when picking the spill lists, 0 for the nearest lists");
+        desc.add_options()("max_list_ratio", po::value<float>(&max_list_ratio)->default_value(0),
+                           "Largest list size allowed by balanced training, relative to the average, 0 for plain k-means");
+        desc.add_options()("cap_lists", po::value<bool>(&cap_lists)->default_value(false),
+                           "Hold add() to max_list_ratio, overflowing to the next-nearest list");
+        desc.add_options()("kmeans_iterations", po::value<ANNS::IdxType>(&Kmeans_iterations)->default_value(20),
+                           "k-means iterations (mini-batches when kmeans_batch_size is set)");
+        desc.add_options()("kmeans_batch_size", po::value<size_t>(&kmeans_batch_size)->default_value(0),
+                           "Training vectors per mini-batch k-means iteration, 0 for full passes");
+        desc.add_options()("kmeans_seeding", po::value<std::string>(&kmeans_seeding)->default_value("random"),
+                           "k-means seeding: random, kmeans++ or kmeans||");
+        desc.add_options()("kmeans_tolerance", po::value<float>(&kmeans_tolerance)->default_value(0),
+                           "Stop k-means once an iteration improves the objective by less than this fraction");
+        desc.add_options()("kmeans_hierarchical", po::value<bool>(&kmeans_hierarchical)->default_value(false),
+                           "Train the coarse k-means in two levels, sqrt(nlist) groups first");
+        desc.add_options()("kmeans_refine", po::value<ANNS::IdxType>(&Kmeans_refine)->default_value(0),
+                           "Full k-means passes after hierarchical training");
+        desc.add_options()("max_points_per_centroid", po::value<size_t>(&max_points_per_centroid)->default_value(256),
+                           "Subsample the k-means training set to this many vectors per centroid (0 uses all)");
+        desc.add_options()("train_sample_size", po::value<size_t>(&train_sample_size)->default_value(0),
+                           "Train on a uniform sample of this many vectors of train_bin_file, drawn in one pass (0 loads it whole)");
+        desc.add_options()("cache_dir", po::value<std::string>(&cache_dir)->default_value(""),
+                           "Directory caching the trained quantizers by training set and options (empty disables)");
     
                            
         
@@ -57,24 +146,128 @@ int main(int argc, char** argv) {
             return 0;
         }
         po::notify(vm);
+        metric = metricFromName(dist_fn);
     } catch (const std::exception &ex) {
         std::cerr << ex.what() << std::endl;
         return -1;
     }
 
+    IVFFlatParameters params;
+    params.metric = metric;
+    params.store_norms = store_norms;
+    params.early_abandon = early_abandon;
+    params.permute_dims = permute_dims;
+    params.batch_by_list = batch_by_list;
+    params.interleave = Interleave;
+    params.pipeline_threads = Pipeline_threads;
+    params.micro_batch = Micro_batch;
+    params.prune_lists = prune_lists;
+    params.sort_lists = sort_lists;
+    params.min_nprobe = Min_nprobe;
+    params.max_nprobe = Max_nprobe;
+    params.probe_ratio = probe_ratio;
+    params.probe_patience = Probe_patience;
+    params.coarse_graph_degree = Coarse_graph_degree;
+    params.coarse_graph_beam = Coarse_graph_beam;
+    params.list_graph_threshold = List_graph_threshold;
+    params.list_graph_degree = List_graph_degree;
+    params.list_graph_beam = List_graph_beam;
+    params.spill = Spill;
+    params.soar_lambda = soar_lambda;
+    params.max_list_ratio = max_list_ratio;
+    params.cap_lists = cap_lists;
+    params.kmeans.iterations = Kmeans_iterations;
+    params.kmeans.batch_size = kmeans_batch_size;
+    params.kmeans.tolerance = kmeans_tolerance;
+    params.kmeans.hierarchical = kmeans_hierarchical;
+    params.kmeans.refine_iterations = Kmeans_refine;
+    params.kmeans.max_points_per_centroid = max_points_per_centroid;
+    params.cache_dir = cache_dir;
+    if (kmeans_seeding == "kmeans++") {
+        params.kmeans.seeding = KMeansSeeding::PLUS_PLUS;
+    } else if (kmeans_seeding == "kmeans||") {
+        params.kmeans.seeding = KMeansSeeding::PARALLEL;
+    } else if (kmeans_seeding != "random") {
+        std::cerr << "Unknown k-means seeding: " << kmeans_seeding << std::endl;
+        return -1;
+    }
+    if (precision == "fp16") {
+        params.precision = ListPrecision::FP16;
+    } else if (precision == "bf16") {
+        params.precision = ListPrecision::BF16;
+    } else if (precision != "fp32") {
+        std::cerr << "Unknown precision: " << precision << std::endl;
+        return -1;
+    }
+    if (layout == "tiled") {
+        params.layout = ListLayout::TILED;
+    } else if (layout != "rows") {
+        std::cerr << "Unknown layout: " << layout << std::endl;
+        return -1;
+    }
+
     // load base and query data
     std::shared_ptr<ANNS::IStorage> base_storage = ANNS::create_storage(data_type);
     std::shared_ptr<ANNS::IStorage> query_storage = ANNS::create_storage(data_type);
     std::shared_ptr<ANNS::IStorage> train_storage = ANNS::create_storage(data_type);
     base_storage->load_from_file(base_bin_file, base_label_file);
     query_storage->load_from_file(query_bin_file, query_label_file);
-    train_storage->load_from_file(train_bin_file, train_label_file); 
+    std::string sample_file;
+    if (train_sample_size > 0) {
+        // labels do not follow the sampled rows, training ignores them; the name is
+        // unique per run so concurrent sweeps do not overwrite each other's sample
+        std::string name = "ivf_train_sample." + std::to_string(getpid()) + "." + std::to_string(std::random_device()()) + ".bin";
+        sample_file = (std::filesystem::temp_directory_path() / name).string();
+        size_t element_size = data_type == "float" ? sizeof(float) : sizeof(uint8_t);
+        try {
+            sampleBinFile(train_bin_file, sample_file, element_size, train_sample_size);
+        } catch (const std::exception &ex) {
+            std::cerr << ex.what() << std::endl;
+            std::filesystem::remove(sample_file);
+            return -1;
+        }
+        train_storage->load_from_file(sample_file, "");
+    } else {
+        train_storage->load_from_file(train_bin_file, train_label_file); 
+    }
 
 
     // load index
-    IndexIVFFlat my_index(Dim, Nprobe, Nlist);
+    IndexIVFFlat my_index(Dim, Nprobe, Nlist, params);
     my_index.train(train_storage);
+    if (!sample_file.empty()) {
+        std::filesystem::remove(sample_file);
+    }
+    if (my_index.loadedFromCache()) {
+        std::cout << "- Loaded the trained centroids from " << cache_dir << std::endl;
+    }
+    const KMeansStats& kmeans_stats = my_index.trainingStats();
+    if (!kmeans_stats.objective.empty()) {
+        std::cout << "- k-means: " << kmeans_stats.iterations << " iterations, objective " << kmeans_stats.objective.front()
+                  << " -> " << kmeans_stats.objective.back() << ", " << kmeans_stats.empty_clusters << " empty clusters, "
+                  << kmeans_stats.seconds << "s" << std::endl;
+    }
     my_index.add(base_storage);
+    std::cout << "- List entries: " << my_index.numEntries() << " for " << my_index.numVectors() << " vectors ("
+              << (double)my_index.numEntries() / std::max<size_t>(my_index.numVectors(), 1) << "x), "
+              << my_index.listBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+    std::cout << "- Largest list: " << my_index.largestList() << " (average "
+              << (double)my_index.numEntries() / Nlist << ")" << std::endl;
+    if (!router_query_file.empty()) {
+        std::shared_ptr<ANNS::IStorage> router_storage = ANNS::create_storage(data_type);
+        router_storage->load_from_file(router_query_file, router_label_file);
+        auto router_gt = new std::pair<ANNS::IdxType, float>[router_storage->get_num_points() * Router_K];
+        ANNS::load_gt_file(router_gt_file, router_gt, router_storage->get_num_points(), Router_K);
+        RouterParameters router_params;
+        router_params.hidden = Router_hidden;
+        my_index.trainRouter(router_storage, router_gt, Router_K, router_params);
+        delete[] router_gt;
+        if (!router_model.empty()) {
+            my_index.saveRouter(router_model);
+        }
+    } else if (!router_model.empty()) {
+        my_index.loadRouter(router_model);
+    }
 
     // perform queries 
     auto num_queries = query_storage->get_num_points(); 
@@ -82,6 +275,7 @@ int main(int argc, char** argv) {
     auto gt = new std::pair<ANNS::IdxType, float>[num_queries * K];
     ANNS::load_gt_file(gt_file, gt, num_queries, K);
     
+    std::cout << "- SIMD kernels: " << simdLevel() << std::endl;
     std::cout << "Start querying ..." << std::endl;
     auto start_time = std::chrono::high_resolution_clock::now();
     my_index.query(query_storage, K, results);
@@ -90,6 +284,12 @@ int main(int argc, char** argv) {
 
     std::cout << "- Time cost: " << time_cost << "ms" << std::endl;
     std::cout << "- QPS: " << num_queries * 1000.0 / time_cost << std::endl;
+    if (Pipeline_threads > 0) {
+        const PipelineStats& stats = my_index.pipelineStats();
+        std::cout << "- Pipeline: " << stats.micro_batches << " micro-batches, assign " << stats.assign * 1000 << "ms (blocked "
+                  << stats.assign_blocked * 1000 << "ms), scan " << stats.scan * 1000 << "ms over " << Pipeline_threads
+                  << " threads (idle " << stats.scan_idle * 1000 << "ms)" << std::endl;
+    }
 
 
     // calculate recall
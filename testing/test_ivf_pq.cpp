@@ -1,9 +1,13 @@
 #include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <numeric>
+#include <random>
 #include <boost/program_options.hpp>
+#include <unistd.h>
 #include "../pq/ivf_pq.h"
+#include "../common/reservoir_sampler.h"
 #include "../../include/utils.h"
 
 namespace po = boost::program_options;
@@ -11,8 +15,13 @@ namespace po = boost::program_options;
 
 
 int main(int argc, char** argv) {
-    std::string data_type, dist_fn, base_bin_file, query_bin_file, train_bin_file, base_label_file, query_label_file, train_label_file, gt_file, index_path_prefix;
-    ANNS::IdxType K, Dim, Nprobe, Nlist, M_val, Nbits;
+    std::string data_type, dist_fn, base_bin_file, query_bin_file, train_bin_file, base_label_file, query_label_file, train_label_file, gt_file, index_path_prefix, cache_dir;
+    Metric metric = Metric::L2;
+    ANNS::IdxType K, Dim, Nprobe, Nlist, M_val, Nbits, Kmeans_iterations, Kmeans_refine;
+    size_t kmeans_batch_size, max_points_per_centroid, train_sample_size;
+    std::string kmeans_seeding;
+    float kmeans_tolerance;
+    bool kmeans_hierarchical;
 
     try {
         po::options_description desc{"Arguments"};
@@ -50,6 +59,24 @@ int main(int argc, char** argv) {
                            "Number of bits");
         desc.add_options()("m_val", po::value<ANNS::IdxType>(&M_val)->required(),
                            "m value");
+        desc.add_options()("kmeans_iterations", po::value<ANNS::IdxType>(&Kmeans_iterations)->default_value(20),
+                           "k-means iterations (mini-batches when kmeans_batch_size is set)");
+        desc.add_options()("kmeans_batch_size", po::value<size_t>(&kmeans_batch_size)->default_value(0),
+                           "Training vectors per mini-batch k-means iteration, 0 for full passes");
+        desc.add_options()("kmeans_seeding", po::value<std::string>(&kmeans_seeding)->default_value("random"),
+                           "k-means seeding: random, kmeans++ or kmeans||");
+        desc.add_options()("kmeans_tolerance", po::value<float>(&kmeans_tolerance)->default_value(0),
+                           "Stop k-means once an iteration improves the objective by less than this fraction");
+        desc.add_options()("kmeans_hierarchical", po::value<bool>(&kmeans_hierarchical)->default_value(false),
+                           "Train the coarse k-means in two levels, sqrt(nlist) groups first");
+        desc.add_options()("kmeans_refine", po::value<ANNS::IdxType>(&Kmeans_refine)->default_value(0),
+                           "Full k-means passes after hierarchical training");
+        desc.add_options()("max_points_per_centroid", po::value<size_t>(&max_points_per_centroid)->default_value(256),
+                           "Subsample the k-means training set to this many vectors per centroid (0 uses all)");
+        desc.add_options()("train_sample_size", po::value<size_t>(&train_sample_size)->default_value(0),
+                           "Train on a uniform sample of this many vectors of train_bin_file, drawn in one pass (0 loads it whole)");
+        desc.add_options()("cache_dir", po::value<std::string>(&cache_dir)->default_value(""),
+                           "Directory caching the trained quantizers by training set and options (empty disables)");
     
                            
         
@@ -62,6 +89,7 @@ int main(int argc, char** argv) {
             return 0;
         }
         po::notify(vm);
+        metric = metricFromName(dist_fn);
     } catch (const std::exception &ex) {
         std::cerr << ex.what() << std::endl;
         return -1;
@@ -73,12 +101,59 @@ int main(int argc, char** argv) {
     std::shared_ptr<ANNS::IStorage> train_storage = ANNS::create_storage(data_type);
     base_storage->load_from_file(base_bin_file, base_label_file);
     query_storage->load_from_file(query_bin_file, query_label_file);
-    train_storage->load_from_file(train_bin_file, train_label_file); 
+    std::string sample_file;
+    if (train_sample_size > 0) {
+        // labels do not follow the sampled rows, training ignores them; the name is
+        // unique per run so concurrent sweeps do not overwrite each other's sample
+        std::string name = "ivf_train_sample." + std::to_string(getpid()) + "." + std::to_string(std::random_device()()) + ".bin";
+        sample_file = (std::filesystem::temp_directory_path() / name).string();
+        size_t element_size = data_type == "float" ? sizeof(float) : sizeof(uint8_t);
+        try {
+            sampleBinFile(train_bin_file, sample_file, element_size, train_sample_size);
+        } catch (const std::exception &ex) {
+            std::cerr << ex.what() << std::endl;
+            std::filesystem::remove(sample_file);
+            return -1;
+        }
+        train_storage->load_from_file(sample_file, "");
+    } else {
+        train_storage->load_from_file(train_bin_file, train_label_file); 
+    }
 
 
     // load index
-    IndexIVFPQ my_index(Dim, Nprobe, Nlist, Nbits, M_val);
+    KMeansParameters kmeans_params;
+    kmeans_params.iterations = Kmeans_iterations;
+    kmeans_params.batch_size = kmeans_batch_size;
+    kmeans_params.tolerance = kmeans_tolerance;
+    kmeans_params.hierarchical = kmeans_hierarchical;
+    kmeans_params.refine_iterations = Kmeans_refine;
+    kmeans_params.max_points_per_centroid = max_points_per_centroid;
+    if (kmeans_seeding == "kmeans++") {
+        kmeans_params.seeding = KMeansSeeding::PLUS_PLUS;
+    } else if (kmeans_seeding == "kmeans||") {
+        kmeans_params.seeding = KMeansSeeding::PARALLEL;
+    } else if (kmeans_seeding != "random") {
+        std::cerr << "Unknown k-means seeding: " << kmeans_seeding << std::endl;
+        if (!sample_file.empty()) {
+            std::filesystem::remove(sample_file);
+        }
+        return -1;
+    }
+    IndexIVFPQ my_index(Dim, Nprobe, Nlist, Nbits, M_val, metric, kmeans_params, cache_dir);
     my_index.train(train_storage);
+    if (!sample_file.empty()) {
+        std::filesystem::remove(sample_file);
+    }
+    if (my_index.loadedFromCache()) {
+        std::cout << "- Loaded the trained centroids and codebooks from " << cache_dir << std::endl;
+    }
+    const KMeansStats& kmeans_stats = my_index.trainingStats();
+    if (!kmeans_stats.objective.empty()) {
+        std::cout << "- k-means: " << kmeans_stats.iterations << " iterations, objective " << kmeans_stats.objective.front()
+                  << " -> " << kmeans_stats.objective.back() << ", " << kmeans_stats.empty_clusters << " empty clusters, "
+                  << kmeans_stats.seconds << "s" << std::endl;
+    }
     my_index.add(base_storage);
 
     //perform queries 
@@ -87,6 +162,7 @@ int main(int argc, char** argv) {
     auto gt = new std::pair<ANNS::IdxType, float>[num_queries * K];
     ANNS::load_gt_file(gt_file, gt, num_queries, K);
     
+    std::cout << "- SIMD kernels: " << simdLevel() << std::endl;
     std::cout << "Start querying ..." << std::endl;
     auto start_time = std::chrono::high_resolution_clock::now();
     my_index.query(query_storage, K, results);